@@ -1,6 +1,7 @@
 #include "app/enemy.h"
 #include "common/assert_handler.h"
 #include "common/trace.h"
+#include "drivers/timestamp.h"
 #include "drivers/vl53lox.h"
 
 #define RANGE_DETECT_THRESHOLD (600u) // mm
@@ -8,6 +9,9 @@
 #define RANGE_CLOSE (100u) // mm
 #define RANGE_MID (200u)   // mm
 #define RANGE_FAR (300u)   // mm
+/* A range this old is ignored (e.g. a sensor stopped responding), the enemy
+ * may have moved a lot since */
+#define RANGE_MAX_AGE_US (200000ul)
 
 // These string functions are nice-to-haves, and can be removed if flash space
 // is an issue
@@ -53,50 +57,50 @@ const char *enemy_range_str(enemy_range_e range) {
 
 struct enemy enemy_get(void) {
   struct enemy enemy = {ENEMY_POS_NONE, ENEMY_RANGE_NONE};
-  vl53l0x_ranges_t ranges;
-  bool fresh_values = false;
-  vl53l0x_result_e result = vl53l0x_read_range_multiple(ranges, &fresh_values);
+  vl53l0x_samples_t samples;
+  vl53l0x_fresh_t fresh;
+  vl53l0x_result_e result = vl53l0x_read_samples_multiple(samples, fresh);
   if (result) {
     TRACE("read range failed %u", result);
     return enemy;
   }
+  vl53l0x_ranges_t ranges;
+  for (int i = 0; i < VL53L0X_IDX_COUNT; i++) {
+    const bool stale =
+        timestamp_elapsed_us(samples[i].timestamp_us) > RANGE_MAX_AGE_US;
+    ranges[i] = stale ? VL53L0X_OUT_OF_RANGE : samples[i].range;
+  }
 
   const uint16_t range_front = ranges[VL53L0X_IDX_FRONT];
   const uint16_t range_front_left = ranges[VL53L0X_IDX_FRONT_LEFT];
   const uint16_t range_front_right = ranges[VL53L0X_IDX_FRONT_RIGHT];
-#if 0 // Skip left and right (badly mounted on the robot)
-    const uint16_t range_left = ranges[VL53L0X_IDX_LEFT];
-    const uint16_t range_right = ranges[VL53L0X_IDX_RIGHT];
-#endif
+  /* Left and right are only measured if enabled with vl53l0x_set_active_mask
+   * (they're mounted badly), else they're always out of range */
+  const uint16_t range_left = ranges[VL53L0X_IDX_LEFT];
+  const uint16_t range_right = ranges[VL53L0X_IDX_RIGHT];
 
   const bool front = range_front < RANGE_DETECT_THRESHOLD;
   const bool front_left = range_front_left < RANGE_DETECT_THRESHOLD;
   const bool front_right = range_front_right < RANGE_DETECT_THRESHOLD;
-#if 0 // Skip left and right (badly mounted on the robot)
-    const bool left = range_left < RANGE_DETECT_THRESHOLD;
-    const bool right = range_right < RANGE_DETECT_THRESHOLD;
-#endif
+  const bool left = range_left < RANGE_DETECT_THRESHOLD;
+  const bool right = range_right < RANGE_DETECT_THRESHOLD;
 
   uint16_t range = INVALID_RANGE;
-#if 0 // Skip left and right (badly mounted on the robot)
-    if (left) {
-        if (front_right || right) {
-            enemy.position = ENEMY_POS_IMPOSSIBLE;
-        } else {
-            enemy.position = ENEMY_POS_LEFT;
-            range = range_left;
-        }
-    } else if (right) {
-        if (front_left || left) {
-            enemy.position = ENEMY_POS_IMPOSSIBLE;
-        } else {
-            enemy.position = ENEMY_POS_RIGHT;
-            range = range_right;
-        }
+  if (left) {
+    if (front_right || right) {
+      enemy.position = ENEMY_POS_IMPOSSIBLE;
+    } else {
+      enemy.position = ENEMY_POS_LEFT;
+      range = range_left;
     }
-#endif
-
-  if (front_left && front && front_right) {
+  } else if (right) {
+    if (front_left || left) {
+      enemy.position = ENEMY_POS_IMPOSSIBLE;
+    } else {
+      enemy.position = ENEMY_POS_RIGHT;
+      range = range_right;
+    }
+  } else if (front_left && front && front_right) {
     enemy.position = ENEMY_POS_FRONT_ALL;
     // Average
     range = ((((range_front_left + range_front) / 2) + range_front_right) / 2);
@@ -173,5 +177,17 @@ void enemy_init(void) {
     TRACE("Failed to initialize vl53l0x %u", result);
     return;
   }
+  // Only read when something is within the detect range
+  result = vl53l0x_set_threshold_mode(RANGE_DETECT_THRESHOLD);
+  if (result) {
+    TRACE("Failed to set threshold mode %u", result);
+    return;
+  }
+  // Free running, so enemy_get only has to read the results
+  result = vl53l0x_start_continuous();
+  if (result) {
+    TRACE("Failed to start continuous ranging %u", result);
+    return;
+  }
   initialized = true;
 }
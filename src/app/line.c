@@ -3,25 +3,42 @@
 
 #include "common/assert_handler.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 // Based on readings from the sensors when they are above the white line
 #define LINE_DETECTED_VOLTAGE_THRESHOLD (700u)
+// So the noise at the edge of the line doesn't toggle the detection
+#define LINE_DETECTED_VOLTAGE_HYSTERESIS (100u)
+
+// Incremented by the ADC interrupt as soon as a sensor crosses the line
+static volatile uint16_t line_crossings = 0;
+static uint16_t line_crossings_seen = 0;
+
+static void line_crossing_isr(void) { line_crossings++; }
 
 static bool initialized = false;
 void line_init(void) {
   ASSERT(!initialized);
   qre1113_init();
+  qre1113_set_threshold(LINE_DETECTED_VOLTAGE_THRESHOLD,
+                        LINE_DETECTED_VOLTAGE_HYSTERESIS, line_crossing_isr);
   initialized = true;
 }
 
+bool line_changed(void) {
+  const uint16_t crossings = line_crossings; // Atomic (16-bit)
+  const bool changed = crossings != line_crossings_seen;
+  line_crossings_seen = crossings;
+  return changed;
+}
+
 line_e line_get(void) {
-  struct qre1113_voltages voltages;
-  qre1113_get_voltages(&voltages);
-  const bool front_left = voltages.front_left < LINE_DETECTED_VOLTAGE_THRESHOLD;
-  const bool front_right =
-      voltages.front_right < LINE_DETECTED_VOLTAGE_THRESHOLD;
-  const bool back_left = voltages.back_left < LINE_DETECTED_VOLTAGE_THRESHOLD;
-  const bool back_right = voltages.back_right < LINE_DETECTED_VOLTAGE_THRESHOLD;
+  struct qre1113_detections detections;
+  qre1113_get_detections(&detections);
+  const bool front_left = detections.front_left;
+  const bool front_right = detections.front_right;
+  const bool back_left = detections.back_left;
+  const bool back_right = detections.back_right;
 
   if (front_left) {
     if (front_right) {
@@ -3,6 +3,8 @@
 
 // Detect the boundary line of circular sumorobot platform
 
+#include <stdbool.h>
+
 typedef enum {
   LINE_NONE,
   LINE_FRONT,
@@ -18,6 +20,11 @@ typedef enum {
 } line_e;
 
 void line_init(void);
+// From the detections of the ADC interrupt, so cheap to call often
 line_e line_get(void);
+/* True if a sensor has crossed the line (either way) since the last call,
+ * e.g. to call line_get only then. The crossing is detected as soon as it's
+ * sampled, not when this is called. */
+bool line_changed(void);
 
 #endif // LINE_H
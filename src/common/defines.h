@@ -3,10 +3,19 @@
 
 #define UNUSED(x) (void)(x)
 #define SUPPRESS_UNUSED __attribute__((unused))
+#define WEAK __attribute__((weak))
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
 
 #define INTERRUPT_FUNCTION(vector) void __attribute__((interrupt(vector)))
 
+/* Disables interrupts and restores the previous state on exit, so unlike a
+ * plain _disable_interrupts/_enable_interrupts pair, it's safe to use from
+ * interrupt context. Must be used as a pair in the same scope. */
+#define CRITICAL_SECTION_ENTER()                                               \
+  const unsigned int interrupt_state_saved = __get_SR_register() & GIE;        \
+  _disable_interrupts()
+#define CRITICAL_SECTION_EXIT() __bis_SR_register(interrupt_state_saved)
+
 #define MODULO_2(x) (x & 1)
 #define IS_ODD(x) MODULO_2(x)
 #define ABS(x) ((x) >= 0 ? (x) : (-x))
@@ -1,76 +1,261 @@
 #include "drivers/adc.h"
 #include "common/assert_handler.h"
 #include "common/defines.h"
+#include "drivers/dma.h"
 #include "drivers/io.h"
+#include <assert.h>
 #include <msp430.h>
 #include <stdbool.h>
+#include <stddef.h>
 
-static volatile uint16_t adc_results[4]; // Array for ADC results
-static volatile uint16_t adc_cache[4];   // Cache for the last ADC results
+/* Oversampling: the DMA copies each sequence into a ring of raw sequences, and
+ * the interrupt keeps a moving sum (boxcar, the integrator and comb of a CIC
+ * filter) of the last ADC_OVERSAMPLING of them per channel. The output is the
+ * average, at the full sample rate (not decimated), with the noise of
+ * uncorrelated samples (e.g. the motor PWM) reduced by sqrt(ADC_OVERSAMPLING).
+ * The ring has two more slots: the DMA reloads the destination before the
+ * interrupt runs (see dma_channel_set_dst), so the next sequence already goes
+ * to the slot after the newest, and the one that has left the window is only
+ * filled the sequence after. The sums of 12-bit samples fit in 16 bits up to
+ * 16x. */
+#define ADC_OVERSAMPLING_LOG2 (2u) // 4x
+#define ADC_OVERSAMPLING (1u << ADC_OVERSAMPLING_LOG2)
+#define ADC_RAW_SLOTS (ADC_OVERSAMPLING + 2)
+static_assert(ADC_OVERSAMPLING_LOG2 <= 4, "Sums must fit in 16 bits");
+static volatile uint16_t adc_raw[ADC_RAW_SLOTS][ADC_CHANNEL_COUNT];
+static uint8_t adc_raw_slot = 0; // Filled by the DMA
+static uint16_t adc_sums[ADC_CHANNEL_COUNT];
+static volatile uint16_t adc_filter_cycles_max = 0;
+
+/* Thresholds with hysteresis, evaluated on each filtered value in the
+ * interrupt: a channel is below once its value drops under low, and until it
+ * rises over high. Not evaluated until the window has been filled once, since
+ * the averages start from zero. */
+static uint16_t adc_threshold_lows[ADC_CHANNEL_COUNT];
+static uint16_t adc_threshold_highs[ADC_CHANNEL_COUNT];
+static volatile uint8_t adc_threshold_mask = 0;
+static volatile uint8_t adc_below_mask = 0;
+static uint8_t adc_window_fill = 0;
+static volatile adc_crossing_function adc_crossing_callback = NULL;
+static volatile adc_sample_function adc_sample_callback = NULL;
+
+/* Ping-pong buffers: the interrupt writes the filtered values of each
+ * sequence to one while the other holds the latest results, then publishes it
+ * by incrementing adc_seq (its parity gives the buffer to read). A reader
+ * checks that adc_seq didn't change while copying (seqlock), so it never has
+ * to disable interrupts. */
+static volatile uint16_t adc_buffers[2][ADC_CHANNEL_COUNT];
+static volatile uint16_t adc_seq = 0; // Atomic (16-bit), 0 until first sample
 static const io_e *adc_pins;             // Array to hold ADC pin configuration
 static uint8_t adc_pin_count;            // Count of ADC pins
 static uint8_t adc_channel_count;        // Total number of ADC channels
+static volatile uint16_t adc_temperature = 0; // Raw, 0 until first sampling
+
+/* The channels are sampled in repeat sequence mode (CONSEQ_3), each
+ * conversion triggered by the rising edge of TB0.1 (ADC12SHS_3), so the
+ * values are refreshed at a fixed rate without the CPU. The timer runs in up
+ * mode and TB0.1 (reset/set) rises once per period, so it runs at the sample
+ * rate times the number of conversions in the sequence. */
+#define ADC_SAMPLE_RATE_HZ (2000u) // Of each channel
+#define ADC_TIMER_FREQ_HZ (SMCLK)
+
+/* Factory calibration of the temperature sensor with the 1.5 V reference, see
+ * the device descriptor table (TLV) in the MSP430F5529 datasheet */
+#define ADC_TEMPERATURE_CAL_30C (*((const uint16_t *)0x1A1A))
+#define ADC_TEMPERATURE_CAL_85C (*((const uint16_t *)0x1A1C))
 
 static bool initialized = false; // Initialization flag
 
+static void adc_timer_init(uint8_t conversion_count) {
+  const uint32_t period_ticks =
+      ADC_TIMER_FREQ_HZ / ((uint32_t)ADC_SAMPLE_RATE_HZ * conversion_count);
+  ASSERT(period_ticks > 1 && period_ticks <= UINT16_MAX);
+  /* TBSSEL_2 : Clock source SMCLK
+   * MC_1 : Up mode (count to TB0CCR0)
+   * OUTMOD_7 : Reset/Set, rises when the timer wraps
+   */
+  TB0CTL = TBCLR;
+  TB0CCR0 = period_ticks - 1;
+  TB0CCR1 = period_ticks / 2;
+  TB0CCTL1 = OUTMOD_7;
+  TB0CTL = TBSSEL_2 + MC_1;
+}
+
 void adc_init(void) {
   ASSERT(!initialized); // Ensure ADC is not already initialized
   adc_pins = io_adc_pins(&adc_pin_count); // Get ADC pin configurations
   adc_channel_count =
       adc_pin_count; // Set total channel count based on available pins
+  ASSERT(adc_pin_count <= ADC_CHANNEL_COUNT);
+  // The pins are converted in order to ADC12MEM0 and up (see io.c)
+  for (uint8_t i = 0; i < adc_pin_count; i++) {
+    ASSERT(io_to_adc_idx(adc_pins[i]) == i);
+  }
 
-  // Enable A/D channel inputs for P6.0 - P6.3
-  P6SEL |= 0x0F;
+  // Enable A/D channel inputs for P6.0 - P6.4
+  P6SEL |= 0x1F;
 
   // Configure DMA for ADC results
-  DMACTL0 = DMA0TSEL_30;           // Select ADC12 as DMA trigger
-  DMA0SA = (uint16_t)&ADC12MEM0;   // Source address (ADC memory)
-  DMA0DA = (uint16_t)&adc_results; // Destination address (adc_results array)
-  DMA0SZ = adc_channel_count;      // Number of transfers
-  DMA0CTL |= DMADT_4 | DMASRCINCR_0 | DMADSTINCR_3 | DMAEN;
+  dma_channel_init(DMA_CHANNEL_ADC, DMA_TRIGGER_ADC12IFG, NULL);
+  const struct dma_transfer adc_transfer = {
+      .src = (uint16_t)&ADC12MEM0,     // Source address (ADC memory)
+      .dst = (uint16_t)adc_raw[0], // See adc_filter
+      .size = adc_channel_count,   // Number of transfers
+      // Repeated block, all results of the sequence on each trigger
+      .ctl = DMADT_5 | DMASRCINCR_3 | DMADSTINCR_3,
+  };
+  dma_channel_start(DMA_CHANNEL_ADC, &adc_transfer);
+  // Reloaded after the first sequence, so the second goes to the next slot
+  dma_channel_set_dst(DMA_CHANNEL_ADC, (uint16_t)adc_raw[1]);
+
+  // The temperature sensor is measured against the internal 1.5 V reference
+  REFCTL0 |= REFMSTR + REFVSEL_0 + REFON;
 
   // Configure ADC
-  ADC12CTL0 =
-      ADC12ON + ADC12MSC + ADC12SHT0_2; // Turn on ADC12, set sampling time
-  ADC12CTL1 = ADC12SHP + ADC12CONSEQ_1; // Use sampling timer, single sequence
+  /* Turn on ADC12, set sampling time (256 cycles, the temperature sensor needs
+   * at least 30 us). One conversion per trigger (no ADC12MSC). */
+  ADC12CTL0 = ADC12ON + ADC12SHT0_8;
+  // Use sampling timer, repeat sequence, triggered by TB0.1
+  ADC12CTL1 = ADC12SHP + ADC12CONSEQ_3 + ADC12SHS_3;
   ADC12MCTL0 = ADC12INCH_0;             // Channel = A0
   ADC12MCTL1 = ADC12INCH_1;             // Channel = A1
   ADC12MCTL2 = ADC12INCH_2;             // Channel = A2
-  ADC12MCTL3 = ADC12INCH_3 + ADC12EOS;  // Channel = A3, end sequence
+  ADC12MCTL3 = ADC12INCH_3;             // Channel = A3
+  ADC12MCTL4 = ADC12INCH_4;             // Channel = A4 (battery)
+  // Temperature sensor (A10), end sequence
+  ADC12MCTL5 = ADC12INCH_10 + ADC12SREF_1 + ADC12EOS;
 
-  ADC12IE = 0x08; // ADC12IE3         // Enable interrupt for last channel (A3)
+  ADC12IE = 0x20; // ADC12IE5      // Enable interrupt for last channel (A10)
   ADC12CTL0 |= ADC12ENC; // Enable conversions
 
+  // Lines, battery and the temperature sensor
+  adc_timer_init(adc_channel_count + 1);
+
   initialized = true; // Set initialized flag
 }
 
+/* Moves the window of each channel by the sequence just copied by the DMA, so
+ * the time is bounded by the number of channels (no loop over the window).
+ * The max is measured on the trigger timer (clocked at MCLK), see
+ * adc_filter_cycles. Returns the channels that crossed their threshold. */
+static uint8_t adc_filter(void) {
+  const uint16_t start = TB0R;
+  const uint8_t threshold_mask =
+      adc_window_fill < ADC_OVERSAMPLING ? 0 : adc_threshold_mask;
+  uint8_t below_mask = adc_below_mask;
+  const volatile uint16_t *newest = adc_raw[adc_raw_slot];
+  // ADC_OVERSAMPLING slots back, i.e. two ahead
+  const volatile uint16_t *oldest = adc_raw[(adc_raw_slot + 2) % ADC_RAW_SLOTS];
+  adc_raw_slot = (adc_raw_slot + 1) % ADC_RAW_SLOTS;
+  volatile uint16_t *back = adc_buffers[(adc_seq + 1) & 1];
+  for (uint8_t i = 0; i < adc_channel_count; i++) {
+    adc_sums[i] += newest[i] - oldest[i];
+    const uint16_t value = adc_sums[i] >> ADC_OVERSAMPLING_LOG2;
+    back[i] = value;
+    const uint8_t bit = 1u << i;
+    if (!(threshold_mask & bit)) {
+      continue;
+    }
+    if (below_mask & bit) {
+      if (value > adc_threshold_highs[i]) {
+        below_mask &= ~bit;
+      }
+    } else if (value < adc_threshold_lows[i]) {
+      below_mask |= bit;
+    }
+  }
+  if (adc_window_fill < ADC_OVERSAMPLING) {
+    adc_window_fill++;
+  }
+  const uint8_t crossed_mask = (below_mask ^ adc_below_mask) & threshold_mask;
+  adc_below_mask = below_mask;
+  // Left the window, so it can be overwritten by the sequence after next
+  dma_channel_set_dst(DMA_CHANNEL_ADC, (uint16_t)oldest);
+  adc_seq++;
+
+  const uint16_t end = TB0R;
+  uint16_t cycles = end - start;
+  if (end < start) { // The timer wrapped (up mode)
+    cycles += TB0CCR0 + 1;
+  }
+  if (cycles > adc_filter_cycles_max) {
+    adc_filter_cycles_max = cycles;
+  }
+  return crossed_mask;
+}
+
 // ADC12 Interrupt Service Routine
 INTERRUPT_FUNCTION(ADC12_VECTOR) ADC12ISR(void) {
   switch (__even_in_range(ADC12IV, 34)) {
   case 0:
     break; // No interrupt
-  case 14: // ADC12IFG3: End of sequence
-    // Cache ADC results
-    for (uint8_t i = 0; i < adc_channel_count; i++) {
-      adc_cache[i] = adc_results[i];
+  case 18: { // ADC12IFG5: End of sequence
+    // The DMA has copied the sequence (triggered by the same flag)
+    const uint8_t crossed_mask = adc_filter();
+    const adc_crossing_function callback = adc_crossing_callback;
+    if (crossed_mask && callback != NULL) {
+      callback(crossed_mask, adc_below_mask);
+    }
+    const adc_sample_function sample_callback = adc_sample_callback;
+    if (adc_window_fill == ADC_OVERSAMPLING && sample_callback != NULL) {
+      sample_callback();
     }
+    adc_temperature = ADC12MEM5;
     __bic_SR_register_on_exit(LPM4_bits); // Exit low power mode
     break;
+  }
   default:
     break;
   }
 }
 
-// Function to start ADC conversion
-static inline void adc_enable_and_start_conversion(void) {
-  ADC12CTL0 |= ADC12SC; // Start conversion
+uint16_t adc_get_channel_values(adc_channel_values_t values) {
+  uint16_t seq = 0;
+  do {
+    seq = adc_seq;
+    /* Only overwritten by the interrupt after another sequence, which changes
+     * adc_seq, so retry then */
+    const volatile uint16_t *buffer = adc_buffers[seq & 1];
+    for (uint8_t i = 0; i < adc_pin_count; i++) {
+      values[i] = buffer[i];
+    }
+  } while (seq != adc_seq);
+  return seq;
 }
 
-// Function to get channel values
-void adc_get_channel_values(adc_channel_values_t values) {
-  _disable_interrupts(); // Disable interrupts globally
-  for (uint8_t i = 0; i < adc_pin_count; i++) {
-    values[i] = adc_cache[i]; // Copy cached values to output
+uint16_t adc_filter_cycles(void) { return adc_filter_cycles_max; }
+
+void adc_set_threshold(uint8_t channel, uint16_t low, uint16_t high) {
+  ASSERT(channel < ADC_CHANNEL_COUNT);
+  ASSERT(low <= high);
+  const uint8_t bit = 1u << channel;
+  // Disabled while changed, so the interrupt never sees half of it
+  adc_threshold_mask &= ~bit;
+  adc_threshold_lows[channel] = low;
+  adc_threshold_highs[channel] = high;
+  adc_threshold_mask |= bit;
+}
+
+void adc_set_crossing_callback(adc_crossing_function function) {
+  adc_crossing_callback = function;
+}
+
+void adc_set_sample_callback(adc_sample_function function) {
+  adc_sample_callback = function;
+}
+
+uint8_t adc_get_below_mask(void) { return adc_below_mask; }
+
+bool adc_get_temperature_c(int16_t *temperature_c) {
+  const uint16_t raw = adc_temperature; // Atomic (16-bit)
+  if (raw == 0) {
+    return false;
   }
-  _enable_interrupts(); // Enable interrupts
+  // Linear between the two calibration points
+  const int32_t cal_30c = ADC_TEMPERATURE_CAL_30C;
+  const int32_t cal_85c = ADC_TEMPERATURE_CAL_85C;
+  *temperature_c = (int16_t)((((int32_t)raw - cal_30c) * (85 - 30)) /
+                                 (cal_85c - cal_30c) +
+                             30);
+  return true;
 }
@@ -1,14 +1,44 @@
 #ifndef ADC_H
 #define ADC_H
 
-// ADC driver sampling the values of the ADC assigned IO pins(see io.c)
+/* ADC driver sampling the values of the ADC assigned IO pins(see io.c) and the
+ * internal temperature sensor, continuously at a fixed rate in the
+ * background (triggered by Timer B0). */
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define ADC_CHANNEL_COUNT (8u)
 typedef uint16_t adc_channel_values_t[ADC_CHANNEL_COUNT];
 
 void adc_init(void);
-void adc_get_channel_values(adc_channel_values_t values);
+/* Copies the latest results (a consistent set from the same sequence) without
+ * disabling interrupts. Returns the index of the sequence, which increments
+ * (and wraps) at each sample (0 before the first), e.g. to know if the values
+ * are new. */
+uint16_t adc_get_channel_values(adc_channel_values_t values);
+/* Max time (in MCLK cycles) taken to filter a sequence in the interrupt, see
+ * the oversampling in adc.c */
+uint16_t adc_filter_cycles(void);
+/* Per-channel thresholds with hysteresis, evaluated in the interrupt on each
+ * sample: a channel is below once its value drops under low, and until it
+ * rises over high. The channels are indexes of adc_channel_values_t. */
+void adc_set_threshold(uint8_t channel, uint16_t low, uint16_t high);
+// Bit n set if channel n is below its threshold (atomic)
+uint8_t adc_get_below_mask(void);
+/* Called from the interrupt as soon as channels cross their threshold, with
+ * the channels that crossed and the ones now below (bit n for channel n), so
+ * the reaction time is bounded by the sample period */
+typedef void (*adc_crossing_function)(uint8_t crossed_mask, uint8_t below_mask);
+void adc_set_crossing_callback(adc_crossing_function function);
+/* Called from the interrupt after each sample (once the oversampling window
+ * is filled), e.g. to filter a channel further. The latest values can be read
+ * with adc_get_channel_values. Keep it short, it delays the next sample. */
+typedef void (*adc_sample_function)(void);
+void adc_set_sample_callback(adc_sample_function function);
+/* Temperature of the internal sensor from the last sampling (false if none
+ * yet, e.g. adc_init not called), calibrated with the factory values of the
+ * TLV. */
+bool adc_get_temperature_c(int16_t *temperature_c);
 
 #endif // ADC_H
@@ -0,0 +1,69 @@
+#include "drivers/battery.h"
+#include "common/assert_handler.h"
+#include "drivers/adc.h"
+#include "drivers/io.h"
+#include <assert.h>
+#include <stdbool.h>
+
+/* The battery (2S, ~8.4 V fully charged) is divided by 3 (20k/10k) to stay
+ * below the reference of the conversion (AVCC, 3.3 V) */
+#define BATTERY_DIVIDER_RATIO (3u)
+#define BATTERY_ADC_REF_MV (3300u)
+#define BATTERY_ADC_MAX (4095u) // 12-bit
+#define BATTERY_ADC_TO_MV(raw)                                                 \
+  ((uint16_t)(((uint32_t)(raw) * BATTERY_ADC_REF_MV * BATTERY_DIVIDER_RATIO) / \
+              BATTERY_ADC_MAX))
+
+/* Exponential moving average of the (already oversampled) ADC value, updated
+ * every BATTERY_DECIMATION samples to keep the interrupt short. The state is
+ * kept with 4 fractional bits (fits 16 bits with 12-bit samples), and each
+ * update moves it by 1 / 2^BATTERY_FILTER_SHIFT of the difference, which
+ * gives a time constant of ~64 ms at 2 kHz. */
+#define BATTERY_DECIMATION (16u)
+#define BATTERY_FILTER_FRAC_BITS (4u)
+#define BATTERY_FILTER_SHIFT (3u)
+static_assert(BATTERY_FILTER_FRAC_BITS + 12 <= 16, "Filter must fit 16 bits");
+
+static uint8_t battery_adc_idx = 0;
+static uint8_t battery_decimation_count = 0;
+static uint16_t battery_filtered = 0; // With BATTERY_FILTER_FRAC_BITS
+static volatile uint16_t battery_voltage_mv = 0; // Atomic, 0 until first
+
+static bool initialized = false;
+
+static void battery_sample_isr(void) {
+  if (++battery_decimation_count < BATTERY_DECIMATION) {
+    return;
+  }
+  battery_decimation_count = 0;
+  adc_channel_values_t values;
+  adc_get_channel_values(values); // Not interrupted by a newer sequence here
+  const uint16_t sample = values[battery_adc_idx] << BATTERY_FILTER_FRAC_BITS;
+  if (battery_voltage_mv == 0) {
+    battery_filtered = sample; // Start from the first value instead of 0
+  } else {
+    const int32_t diff = (int32_t)sample - battery_filtered;
+    battery_filtered += diff >> BATTERY_FILTER_SHIFT;
+  }
+  const uint16_t voltage_mv =
+      BATTERY_ADC_TO_MV(battery_filtered >> BATTERY_FILTER_FRAC_BITS);
+  // Keep 0 for "not measured", a dead battery reads 1 mV instead
+  battery_voltage_mv = voltage_mv ? voltage_mv : 1;
+}
+
+void battery_init(void) {
+  ASSERT(!initialized);
+  battery_adc_idx = io_to_adc_idx(IO_BATTERY_VOLTAGE);
+  ASSERT(battery_adc_idx < ADC_CHANNEL_COUNT);
+  adc_set_sample_callback(battery_sample_isr);
+  initialized = true;
+}
+
+bool battery_get_voltage_mv(uint16_t *voltage_mv) {
+  const uint16_t mv = battery_voltage_mv;
+  if (mv == 0) {
+    return false;
+  }
+  *voltage_mv = mv;
+  return true;
+}
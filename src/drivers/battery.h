@@ -0,0 +1,18 @@
+#ifndef BATTERY_H
+#define BATTERY_H
+
+/* Driver measuring the battery voltage through the voltage divider on
+ * IO_BATTERY_VOLTAGE, which is part of the ADC sequence (see adc.c). The
+ * voltage is low-pass filtered in the ADC interrupt, so it follows the
+ * discharge and the sag under load, but not the ripple of the motor PWM. */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Doesn't start the ADC, the values are filtered once it's sampling
+void battery_init(void);
+/* Filtered battery voltage (false if none yet, e.g. the ADC isn't sampling)
+ */
+bool battery_get_voltage_mv(uint16_t *voltage_mv);
+
+#endif // BATTERY_H
@@ -0,0 +1,96 @@
+#include "drivers/dma.h"
+#include "common/assert_handler.h"
+#include "common/defines.h"
+#include <msp430.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DMA_TSEL_MASK (0x1Fu)
+
+/* The trigger select fields of two channels share one register (DMACTL0 holds
+ * channel 0 and 1, DMACTL1 holds channel 2), so a channel must only ever
+ * modify its own field or it would change the trigger of the other channel. */
+struct dma_tsel {
+  volatile unsigned int *const reg;
+  uint8_t shift;
+};
+
+static const struct dma_tsel dma_tsels[DMA_CHANNEL_COUNT] = {
+    {&DMACTL0, 0},
+    {&DMACTL0, 8},
+    {&DMACTL1, 0},
+};
+
+static volatile unsigned int *const dma_ctl_regs[DMA_CHANNEL_COUNT] = {
+    &DMA0CTL, &DMA1CTL, &DMA2CTL};
+static volatile unsigned int *const dma_sz_regs[DMA_CHANNEL_COUNT] = {
+    &DMA0SZ, &DMA1SZ, &DMA2SZ};
+// Word writes to the lower half of the 20-bit address registers clear the rest
+static volatile unsigned int *const dma_sa_regs[DMA_CHANNEL_COUNT] = {
+    &DMA0SAL, &DMA1SAL, &DMA2SAL};
+static volatile unsigned int *const dma_da_regs[DMA_CHANNEL_COUNT] = {
+    &DMA0DAL, &DMA1DAL, &DMA2DAL};
+
+static bool dma_channel_initialized[DMA_CHANNEL_COUNT] = {false};
+static dma_isr_function dma_isr_functions[DMA_CHANNEL_COUNT] = {NULL};
+
+void dma_channel_init(dma_channel_e channel, dma_trigger_e trigger,
+                      dma_isr_function isr) {
+  ASSERT(channel < DMA_CHANNEL_COUNT);
+  ASSERT(!dma_channel_initialized[channel]);
+
+  *dma_ctl_regs[channel] = 0;
+  const struct dma_tsel *tsel = &dma_tsels[channel];
+  *tsel->reg = (*tsel->reg & ~(DMA_TSEL_MASK << tsel->shift)) |
+               ((uint16_t)trigger << tsel->shift);
+  dma_isr_functions[channel] = isr;
+
+  dma_channel_initialized[channel] = true;
+}
+
+void dma_channel_start(dma_channel_e channel,
+                       const struct dma_transfer *transfer) {
+  ASSERT(dma_channel_initialized[channel]);
+  ASSERT(transfer->size > 0);
+  ASSERT(!(transfer->ctl & DMAEN));
+
+  // Must be disabled while configuring
+  *dma_ctl_regs[channel] = 0;
+  *dma_sa_regs[channel] = transfer->src;
+  *dma_da_regs[channel] = transfer->dst;
+  *dma_sz_regs[channel] = transfer->size;
+  *dma_ctl_regs[channel] = transfer->ctl | DMAEN;
+}
+
+void dma_channel_set_dst(dma_channel_e channel, uint16_t dst) {
+  ASSERT(dma_channel_initialized[channel]);
+  *dma_da_regs[channel] = dst;
+}
+
+void dma_channel_stop(dma_channel_e channel) {
+  // Also clears any pending DMAIFG
+  *dma_ctl_regs[channel] = 0;
+}
+
+static inline void dma_isr(dma_channel_e channel) {
+  if (dma_isr_functions[channel] != NULL) {
+    dma_isr_functions[channel]();
+  }
+}
+
+// All channels share this vector, reading DMAIV clears the corresponding flag
+INTERRUPT_FUNCTION(DMA_VECTOR) isr_dma(void) {
+  switch (__even_in_range(DMAIV, DMAIV_DMA2IFG)) {
+  case DMAIV_DMA0IFG:
+    dma_isr(DMA_CHANNEL_ADC);
+    break;
+  case DMAIV_DMA1IFG:
+    dma_isr(DMA_CHANNEL_I2C_RX);
+    break;
+  case DMAIV_DMA2IFG:
+    dma_isr(DMA_CHANNEL_I2C_TX);
+    break;
+  default:
+    break;
+  }
+}
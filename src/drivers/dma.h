@@ -0,0 +1,50 @@
+#ifndef DMA_H
+#define DMA_H
+
+// Driver for sharing the DMA controller between the peripheral drivers
+
+#include <stdint.h>
+
+/* Each channel has a single owner, which is assigned here to catch two drivers
+ * claiming the same channel. Channel 0 has the highest priority. */
+typedef enum {
+  DMA_CHANNEL_ADC,
+  DMA_CHANNEL_I2C_RX,
+  DMA_CHANNEL_I2C_TX,
+  DMA_CHANNEL_COUNT
+} dma_channel_e;
+
+// Trigger sources (see DMA trigger assignments in the MSP430F5529 datasheet)
+typedef enum {
+  DMA_TRIGGER_SOFTWARE = 0,
+  DMA_TRIGGER_UCB0RXIFG = 18,
+  DMA_TRIGGER_UCB0TXIFG = 19,
+  DMA_TRIGGER_ADC12IFG = 24,
+} dma_trigger_e;
+
+/* The addresses are 16-bit since all RAM and peripheral registers are in the
+ * lower 64KB. ctl is the value for DMAxCTL (transfer mode, increments, byte or
+ * word, DMAIE) excluding DMAEN, see the DMA chapter in the user guide. */
+struct dma_transfer {
+  uint16_t src;
+  uint16_t dst;
+  uint16_t size;
+  uint16_t ctl;
+};
+
+// Called from interrupt context when a transfer with DMAIE set is done
+typedef void (*dma_isr_function)(void);
+
+void dma_channel_init(dma_channel_e channel, dma_trigger_e trigger,
+                      dma_isr_function isr);
+void dma_channel_start(dma_channel_e channel,
+                       const struct dma_transfer *transfer);
+void dma_channel_stop(dma_channel_e channel);
+
+/* Changes the destination of a running repeated transfer (DMADT_4/5). The
+ * address is reloaded from DMAxDA as soon as a repetition is done, before its
+ * interrupt runs, so when called from there it's used from the repetition
+ * after next. Safe to call from interrupt context. */
+void dma_channel_set_dst(dma_channel_e channel, uint16_t dst);
+
+#endif // DMA_H
@@ -1,109 +1,617 @@
 #include "drivers/i2c.h"
 #include "common/assert_handler.h"
 #include "common/defines.h"
+#include "common/trace.h"
+#include "drivers/dma.h"
 #include "drivers/io.h"
+#include "drivers/timestamp.h"
+#include <assert.h>
 #include <msp430.h>
-#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 
 #define DEFAULT_SLAVE_ADDRESS (0X29)
-#define RETRY_COUNT (UINT16_MAX)
+
+/* The transaction at the head of the queue is the one on the bus. The queue is
+ * shared with the interrupts, so it's only modified inside a critical section
+ * (or from the interrupts). */
+static struct i2c_transaction *queue_head = NULL;
+static struct i2c_transaction *queue_tail = NULL;
+
+typedef enum {
+  I2C_STATE_IDLE,
+  I2C_STATE_START, // Slave address not acknowledged yet
+  I2C_STATE_TX,
+  I2C_STATE_RX,
+} i2c_state_e;
+
+static volatile i2c_state_e state = I2C_STATE_IDLE;
+static uint8_t tx_idx = 0;       // Number of bytes written to TXBUF
+static uint8_t tx_count = 0;     // Register address (+ write data) bytes
+static uint8_t rx_remaining = 0; // Bytes left to read
+static bool dma_active = false;
+static uint32_t transaction_start_us = 0;
+
+/* Data phases of at least this many bytes are moved by DMA instead of the
+ * interrupt. Below this the DMA setup costs about as much as the interrupts. */
+#define I2C_DMA_MIN_SIZE (4u)
+
+/* The bit clock is SMCLK divided by the prescaler (UCB0BRW). The prescaler
+ * must be at least 4 in master mode and fast mode is limited to 400 kHz. */
+#define I2C_PRESCALER(hz) (SMCLK / (hz))
+#define I2C_PRESCALER_MIN (4u)
+#define I2C_PRESCALER_MAX (0xFFFFu)
+#define I2C_SPEED_VALID(hz)                                                    \
+  ((hz) <= I2C_SPEED_FAST_HZ && I2C_PRESCALER(hz) >= I2C_PRESCALER_MIN &&     \
+   I2C_PRESCALER(hz) <= I2C_PRESCALER_MAX)
+static_assert(I2C_SPEED_VALID(I2C_SPEED_STANDARD_HZ), "Invalid I2C speed");
+static_assert(I2C_SPEED_VALID(I2C_SPEED_FAST_HZ), "Invalid I2C speed");
+static_assert(I2C_SPEED_VALID(I2C_SPEED_CUSTOM_HZ), "Invalid I2C speed");
+
+static const uint16_t i2c_prescalers[I2C_SPEED_COUNT] = {
+    [I2C_SPEED_STANDARD] = I2C_PRESCALER(I2C_SPEED_STANDARD_HZ), // 160
+    [I2C_SPEED_FAST] = I2C_PRESCALER(I2C_SPEED_FAST_HZ),         // 40
+    [I2C_SPEED_CUSTOM] = I2C_PRESCALER(I2C_SPEED_CUSTOM_HZ),
+};
+
+// Bit time rounded up, used for the timeouts
+#define I2C_BIT_TIME_US(hz) ((1000000u + (hz)-1) / (hz))
+static const uint8_t i2c_bit_times_us[I2C_SPEED_COUNT] = {
+    [I2C_SPEED_STANDARD] = I2C_BIT_TIME_US(I2C_SPEED_STANDARD_HZ),
+    [I2C_SPEED_FAST] = I2C_BIT_TIME_US(I2C_SPEED_FAST_HZ),
+    [I2C_SPEED_CUSTOM] = I2C_BIT_TIME_US(I2C_SPEED_CUSTOM_HZ),
+};
+
+/* Each byte on the bus (slave address, register address, data) is 9 bits
+ * including the ACK. The margin covers the interrupt latency and a few bits
+ * for the start and stop conditions. */
+#define I2C_BITS_PER_BYTE (9u)
+#define I2C_TIMEOUT_MARGIN_US (100u)
+/* The stop condition is requested as soon as the last byte has moved to the
+ * shift register (or starts being received), so the byte, its ACK and the
+ * stop condition itself are still to go out on the bus */
+#define I2C_STOP_TIMEOUT_BITS (I2C_BITS_PER_BYTE + 3u)
+// Slave address + restart when polling for it to be sent
+#define I2C_START_TIMEOUT_BITS (2u * I2C_BITS_PER_BYTE + 2u)
+
+static i2c_speed_e current_speed = I2C_SPEED_STANDARD;
+static uint8_t slave_address = DEFAULT_SLAVE_ADDRESS;
+static i2c_speed_e speed_blocking = I2C_SPEED_STANDARD;
+static i2c_timeout_e last_timeout = I2C_TIMEOUT_NONE;
+
+#define I2C_INTERRUPTS (UCNACKIE + UCTXIE + UCRXIE)
+
+static inline void i2c_enable_interrupts(void) { UCB0IE |= I2C_INTERRUPTS; }
 
 static inline void i2c_set_tx_byte(uint8_t byte) { UCB0TXBUF = byte; }
 
-static i2c_result_e i2c_wait_tx_byte(void) {
-  uint16_t retries = RETRY_COUNT;
-  while (!(UCTXIFG) && retries--) {
+static inline uint8_t i2c_get_rx_byte(void) { return UCB0RXBUF; }
+
+static inline void i2c_send_stop_condition(void) { UCB0CTL1 |= UCTXSTP; }
+
+// The register address is sent first, followed by the data (if writing)
+static uint8_t i2c_tx_byte(const struct i2c_transaction *transaction,
+                           uint8_t idx) {
+  if (idx < transaction->addr_size) {
+    return transaction->addr[idx];
   }
-  if (retries == 0) {
-    return I2C_RESULT_ERROR_TIMEOUT;
+  return transaction->tx_data[idx - transaction->addr_size];
+}
+
+/* Polls a UCB0CTL1 bit until the hardware clears it, or until the deadline
+ * (given in bit times at the current speed) has passed. */
+static bool i2c_wait_ctl1_cleared(uint8_t bit, uint8_t timeout_bits) {
+  const uint16_t timeout_us = timeout_bits * i2c_bit_times_us[current_speed];
+  const uint32_t start_us = timestamp_us();
+  while (UCB0CTL1 & bit) {
+    if (timestamp_elapsed_us(start_us) > timeout_us) {
+      return false;
+    }
   }
-  return (UCB0STAT & UCNACKIFG) ? I2C_RESULT_ERROR_TX : I2C_RESULT_OK;
+  return true;
 }
 
-static i2c_result_e i2c_wait_rx_byte(void) {
-  uint16_t retries = RETRY_COUNT;
-  while (!(UCRXIFG) && retries--) {
+static uint16_t i2c_timeout_us(const struct i2c_transaction *transaction) {
+  if (transaction->timeout_us) {
+    return transaction->timeout_us;
   }
-  if (retries == 0) {
-    return I2C_RESULT_ERROR_TIMEOUT;
+  // Slave address (twice when reading) + register address + data
+  const uint16_t bytes = 1 + (transaction->dir == I2C_DIR_READ ? 1 : 0) +
+                         transaction->addr_size + transaction->data_size;
+  const uint32_t timeout_us =
+      2ul * bytes * I2C_BITS_PER_BYTE * i2c_bit_times_us[transaction->speed] +
+      I2C_TIMEOUT_MARGIN_US;
+  return timeout_us < TIMESTAMP_ALARM_MAX_US ? timeout_us
+                                             : TIMESTAMP_ALARM_MAX_US;
+}
+
+static inline bool i2c_use_dma(const struct i2c_transaction *transaction) {
+  return transaction->data_size >= I2C_DMA_MIN_SIZE;
+}
+
+static void i2c_reverse_bytes(uint8_t *data, uint8_t size) {
+  for (uint8_t i = 0, j = size - 1; i < j; i++, j--) {
+    const uint8_t tmp = data[i];
+    data[i] = data[j];
+    data[j] = tmp;
   }
-  return (UCB0STAT & UCNACKIFG) ? I2C_RESULT_ERROR_RX : I2C_RESULT_OK;
 }
 
-static inline uint8_t i2c_get_rx_byte(void) { return UCB0RXBUF; }
+static void i2c_stop_dma(void) {
+  if (dma_active) {
+    dma_channel_stop(DMA_CHANNEL_I2C_RX);
+    dma_channel_stop(DMA_CHANNEL_I2C_TX);
+    dma_active = false;
+  }
+  // The interrupts are disabled while DMA owns the flags
+  i2c_enable_interrupts();
+}
 
-static inline void i2c_send_start_condition(void) {
-  // Send start condition (and slave addr)
-  UCB0CTL1 |= UCTXSTT;
+/* Resets USCI_B0 (releases the bus), which also clears its interrupt enables,
+ * so they are enabled again here. */
+static void i2c_configure(i2c_speed_e speed) {
+  // Must set reset while configuring
+  UCB0CTL1 |= UCSWRST;
+
+  // Single master, synchronous mode, I2C mode
+  UCB0CTL0 = UCMST + UCSYNC + UCMODE_3;
+
+  // SMCLK
+  UCB0CTL1 |= UCSSEL_2;
+
+  // SMCLK/prescaler (e.g. 16 MHz / 160 = 100 kHz)
+  const uint16_t prescaler = i2c_prescalers[speed];
+  UCB0BR0 = prescaler & 0xFF;
+  UCB0BR1 = prescaler >> 8;
+  current_speed = speed;
+
+  // Clear reset
+  UCB0CTL1 &= ~UCSWRST;
+
+  i2c_enable_interrupts();
 }
 
-static i2c_result_e i2c_wait_start_condition(void) {
-  uint16_t retries = RETRY_COUNT;
-  while ((UCB0CTL1 & UCTXSTT) && --retries) {
+static void i2c_timeout_isr(void);
+#ifndef DISABLE_I2C_STATS
+static void i2c_stats_record_stop_timeout(void);
+#else
+#define i2c_stats_record_stop_timeout() ;
+#endif
+
+static void i2c_start_transaction(struct i2c_transaction *transaction) {
+  /* The stop condition of the previous transaction is sent in the background
+   * (at the speed of that transaction), so wait for it to finish before
+   * starting the next one. Only if it hangs, the reset below releases the bus
+   * (cutting off whatever was left). */
+  const bool stopped = i2c_wait_ctl1_cleared(UCTXSTP, I2C_STOP_TIMEOUT_BITS);
+  if (!stopped) {
+    i2c_stats_record_stop_timeout();
+  }
+  if (!stopped || transaction->speed != current_speed) {
+    i2c_configure(transaction->speed);
   }
-  if (retries == 0) {
-    return I2C_RESULT_ERROR_TIMEOUT;
+  UCB0I2CSA = transaction->slave_addr;
+  tx_idx = 0;
+  tx_count = transaction->addr_size;
+  if (transaction->dir == I2C_DIR_WRITE) {
+    tx_count += transaction->data_size;
   }
-  return (UCB0STAT & UCNACKIFG) ? I2C_RESULT_ERROR_START : I2C_RESULT_OK;
+  rx_remaining = transaction->dir == I2C_DIR_READ ? transaction->data_size : 0;
+  transaction->status = I2C_STATUS_ONGOING;
+  transaction->timeout = I2C_TIMEOUT_NONE;
+  state = I2C_STATE_START;
+  transaction_start_us = timestamp_us();
+  timestamp_alarm_start(TIMESTAMP_ALARM_I2C, i2c_timeout_us(transaction),
+                        i2c_timeout_isr);
+
+  /* Always start as sender (to send the register address). UCTXIFG is set as
+   * soon as the start condition is generated and the interrupt takes it from
+   * there. */
+  UCB0CTL1 |= UCTR + UCTXSTT;
 }
 
-static i2c_result_e i2c_send_addr(const uint8_t *addr, uint8_t addr_size) {
-  // Configure as sender
-  UCB0CTL1 |= UCTR;
-  i2c_send_start_condition();
+#ifndef DISABLE_I2C_STATS
+static struct i2c_stats stats;
 
-  // Note, when master is TX, we must write to TXBUF before waiting for UCTXSTT
-  i2c_set_tx_byte(addr[0]);
-  i2c_result_e result = i2c_wait_start_condition();
-  if (result) {
-    return result;
+static uint8_t i2c_stats_bin(uint16_t duration_us) {
+  uint8_t bin = 0;
+  while (duration_us >>= 1) {
+    bin++;
   }
-  result = i2c_wait_tx_byte();
-  if (result) {
-    return result;
+  return bin;
+}
+
+static struct i2c_slave_stats *i2c_stats_slave(uint8_t slave_addr) {
+  for (uint8_t i = 0; i < I2C_STATS_SLAVE_COUNT; i++) {
+    struct i2c_slave_stats *slave = &stats.slaves[i];
+    if (slave->slave_addr == slave_addr) {
+      return slave;
+    }
+    if (slave->slave_addr == 0) {
+      slave->slave_addr = slave_addr;
+      return slave;
+    }
   }
+  return NULL;
+}
 
-  // Send from most to least significant byte
-  for (uint8_t i = 1; i < addr_size; i++) {
-    i2c_set_tx_byte(addr[i]);
-    result = i2c_wait_tx_byte();
-    if (result) {
-      return result;
+// Called from the interrupt (or with interrupts disabled)
+static void i2c_stats_record(const struct i2c_transaction *transaction,
+                             i2c_result_e result) {
+  stats.transactions++;
+  stats.busy_us += transaction->duration_us;
+  if (stats.results[result] < UINT16_MAX) {
+    stats.results[result]++;
+  }
+  if (result == I2C_RESULT_OK) {
+    stats.bytes += transaction->addr_size + transaction->data_size;
+  }
+  struct i2c_slave_stats *slave = i2c_stats_slave(transaction->slave_addr);
+  if (slave == NULL) {
+    if (stats.untracked < UINT16_MAX) {
+      stats.untracked++;
     }
+    return;
+  }
+  uint16_t *bin = &slave->histogram[i2c_stats_bin(transaction->duration_us)];
+  if (*bin < UINT16_MAX) {
+    (*bin)++;
   }
+}
 
-  return result;
+static void i2c_stats_record_recovery(bool recovered) {
+  if (stats.bus_stuck < UINT16_MAX) {
+    stats.bus_stuck++;
+  }
+  if (recovered && stats.bus_recovered < UINT16_MAX) {
+    stats.bus_recovered++;
+  }
 }
 
-static i2c_result_e i2c_start_tx_transfer(const uint8_t *addr,
-                                          uint8_t addr_size) {
-  return i2c_send_addr(addr, addr_size);
+static void i2c_stats_record_stop_timeout(void) {
+  if (stats.stop_timeouts < UINT16_MAX) {
+    stats.stop_timeouts++;
+  }
 }
 
-static i2c_result_e i2c_start_rx_transfer(const uint8_t *addr,
-                                          uint8_t addr_size) {
-  i2c_result_e result = i2c_send_addr(addr, addr_size);
-  if (result) {
-    return result;
+void i2c_stats_get(struct i2c_stats *copy) {
+  CRITICAL_SECTION_ENTER();
+  *copy = stats;
+  CRITICAL_SECTION_EXIT();
+}
+
+void i2c_stats_reset(void) {
+  CRITICAL_SECTION_ENTER();
+  memset(&stats, 0, sizeof(stats));
+  CRITICAL_SECTION_EXIT();
+}
+
+void i2c_stats_trace(void) {
+  struct i2c_stats copy;
+  i2c_stats_get(&copy);
+  TRACE("i2c %lu transactions %lu bytes %lu us busy", copy.transactions,
+        copy.bytes, copy.busy_us);
+  TRACE("i2c errors start %u tx %u rx %u stop %u timeout %u untracked %u",
+        copy.results[I2C_RESULT_ERROR_START], copy.results[I2C_RESULT_ERROR_TX],
+        copy.results[I2C_RESULT_ERROR_RX], copy.results[I2C_RESULT_ERROR_STOP],
+        copy.results[I2C_RESULT_ERROR_TIMEOUT], copy.untracked);
+  TRACE("i2c bus stuck %u recovered %u stop timeouts %u", copy.bus_stuck,
+        copy.bus_recovered, copy.stop_timeouts);
+  for (uint8_t i = 0; i < I2C_STATS_SLAVE_COUNT; i++) {
+    const struct i2c_slave_stats *slave = &copy.slaves[i];
+    if (slave->slave_addr == 0) {
+      break;
+    }
+    for (uint8_t bin = 0; bin < I2C_STATS_HISTOGRAM_BINS; bin++) {
+      if (slave->histogram[bin]) {
+        TRACE("i2c 0x%x >= %u us: %u", slave->slave_addr,
+              bin ? 1u << bin : 0u, slave->histogram[bin]);
+      }
+    }
   }
+}
+#else
+#define i2c_stats_record(transaction, result) ;
+#define i2c_stats_record_recovery(recovered) ;
+#endif
+
+// Removes the head transaction and starts the next one (if any)
+static void i2c_finish_transaction(i2c_result_e result) {
+  struct i2c_transaction *transaction = queue_head;
+  const i2c_callback callback = transaction->callback;
+  timestamp_alarm_stop(TIMESTAMP_ALARM_I2C);
+  transaction->duration_us = timestamp_elapsed_us(transaction_start_us);
+  i2c_stats_record(transaction, result);
+  i2c_stop_dma();
+  queue_head = transaction->next;
+  if (queue_head == NULL) {
+    queue_tail = NULL;
+  }
+  transaction->next = NULL;
+  transaction->result = result;
+  transaction->status = I2C_STATUS_DONE;
+
+  if (queue_head) {
+    i2c_start_transaction(queue_head);
+  } else {
+    state = I2C_STATE_IDLE;
+  }
+
+  if (callback) {
+    callback(transaction);
+  }
+}
 
-  // Configure receiver
+/* Sends a restart as receiver. When receiving a single byte, the stop condition
+ * must be set while the byte is being received, which means we must poll
+ * UCTXSTT until the slave address has been sent (as recommended by TI). If it
+ * isn't sent in time, the transaction deadline takes care of it. */
+static void i2c_restart_as_receiver(void) {
   UCB0CTL1 &= ~UCTR;
-  i2c_send_start_condition();
-  result = i2c_wait_start_condition();
-  return result;
+  UCB0CTL1 |= UCTXSTT;
+  state = I2C_STATE_RX;
+  if (rx_remaining == 1) {
+    if (i2c_wait_ctl1_cleared(UCTXSTT, I2C_START_TIMEOUT_BITS)) {
+      i2c_send_stop_condition();
+    }
+  }
+}
+
+/* The DMA moves all but the last byte from RXBUF. The stop condition must be
+ * sent while the last byte is being received, so stop the DMA one byte short
+ * and let the interrupt handle the last byte. */
+static void i2c_start_rx_dma(void) {
+  const struct dma_transfer transfer = {
+      .src = (uint16_t)&UCB0RXBUF,
+      .dst = (uint16_t)queue_head->rx_data,
+      .size = rx_remaining - 1,
+      .ctl = DMADT_0 | DMASRCINCR_0 | DMADSTINCR_3 | DMASBDB | DMAIE,
+  };
+  UCB0IE &= ~UCRXIE;
+  dma_active = true;
+  dma_channel_start(DMA_CHANNEL_I2C_RX, &transfer);
+}
+
+static void i2c_rx_dma_done(void) {
+  i2c_send_stop_condition();
+  rx_remaining = 1;
+  UCB0IE |= UCRXIE;
+}
+
+/* The first data byte is written here (UCTXIFG has already been cleared by the
+ * interrupt vector read), and the DMA writes the rest on each UCTXIFG. */
+static void i2c_start_tx_dma(void) {
+  i2c_set_tx_byte(i2c_tx_byte(queue_head, tx_idx));
+  tx_idx++;
+  const struct dma_transfer transfer = {
+      .src = (uint16_t)&queue_head->tx_data[1],
+      .dst = (uint16_t)&UCB0TXBUF,
+      .size = tx_count - tx_idx,
+      .ctl = DMADT_0 | DMASRCINCR_3 | DMADSTINCR_0 | DMASBDB | DMAIE,
+  };
+  UCB0IE &= ~UCTXIE;
+  dma_active = true;
+  dma_channel_start(DMA_CHANNEL_I2C_TX, &transfer);
+}
+
+/* The last byte is still in TXBUF, the interrupt fires when it has moved to
+ * the shift register and sends the stop condition. */
+static void i2c_tx_dma_done(void) {
+  tx_idx = tx_count;
+  UCB0IE |= UCTXIE;
+}
+
+static void i2c_handle_tx(void) {
+  if (tx_idx > 0) {
+    // The previous byte left TXBUF, so the slave address was acknowledged
+    state = I2C_STATE_TX;
+  }
+  if (tx_idx < tx_count) {
+    if (tx_idx == queue_head->addr_size && i2c_use_dma(queue_head)) {
+      i2c_start_tx_dma();
+    } else {
+      i2c_set_tx_byte(i2c_tx_byte(queue_head, tx_idx));
+      tx_idx++;
+    }
+  } else if (queue_head->dir == I2C_DIR_READ) {
+    if (i2c_use_dma(queue_head)) {
+      i2c_start_rx_dma();
+    }
+    i2c_restart_as_receiver();
+  } else {
+    i2c_send_stop_condition();
+    i2c_finish_transaction(I2C_RESULT_OK);
+  }
+}
+
+static void i2c_handle_rx(void) {
+  if (dma_active) {
+    // The DMA stored the bytes in the order received, reverse them afterwards
+    const uint8_t data_size = queue_head->data_size;
+    queue_head->rx_data[data_size - 1] = i2c_get_rx_byte();
+    i2c_reverse_bytes(queue_head->rx_data, data_size);
+    rx_remaining = 0;
+    i2c_finish_transaction(I2C_RESULT_OK);
+    return;
+  }
+
+  // Read bytes from most to least significant byte
+  rx_remaining--;
+  queue_head->rx_data[rx_remaining] = i2c_get_rx_byte();
+  if (rx_remaining == 1) {
+    // Must stop before last byte
+    i2c_send_stop_condition();
+  } else if (rx_remaining == 0) {
+    i2c_finish_transaction(I2C_RESULT_OK);
+  }
+}
+
+static void i2c_handle_nack(void) {
+  i2c_send_stop_condition();
+  const i2c_result_e result = (state == I2C_STATE_TX) ? I2C_RESULT_ERROR_TX
+                                                      : I2C_RESULT_ERROR_START;
+  i2c_finish_transaction(result);
+}
+
+static i2c_timeout_e i2c_timeout_reason(void) {
+  switch (state) {
+  case I2C_STATE_IDLE:
+    break;
+  case I2C_STATE_START:
+    // UCTXIFG is set when the start condition has been sent
+    return tx_idx == 0 ? I2C_TIMEOUT_BUS_BUSY : I2C_TIMEOUT_START;
+  case I2C_STATE_TX:
+    return I2C_TIMEOUT_TX;
+  case I2C_STATE_RX:
+    return I2C_TIMEOUT_RX;
+  }
+  return I2C_TIMEOUT_NONE;
+}
+
+/* A slave that lost clock pulses keeps driving SDA low until it has clocked
+ * out the rest of its byte, so up to 9 pulses (8 bits + ACK) frees it */
+#define I2C_RECOVERY_CLOCK_PULSES (9u)
+#define I2C_RECOVERY_HALF_BIT_CYCLES (MCLK / (2 * I2C_SPEED_STANDARD_HZ))
+
+WEAK bool i2c_line_released(io_e io) {
+  return io_get_input(io) == IO_IN_HIGH;
+}
+
+// Only meaningful while USCI_B0 isn't driving the lines
+static inline bool i2c_bus_stuck(void) {
+  return !i2c_line_released(IO_I2C_SDA) || !i2c_line_released(IO_I2C_SCL);
+}
+
+/* The pins are driven as open drain while in GPIO mode: the output register is
+ * low, so output drives the line low and input releases it (external
+ * pull-ups). */
+static inline void i2c_pull_line(io_e io) {
+  io_set_direction(io, IO_DIR_OUTPUT);
+}
+static inline void i2c_release_line(io_e io) {
+  io_set_direction(io, IO_DIR_INPUT);
+}
+
+static inline void i2c_half_bit_delay(void) {
+  __delay_cycles(I2C_RECOVERY_HALF_BIT_CYCLES);
 }
 
-i2c_result_e i2c_stop_transfer(void) {
-  // Send stop condition
-  UCB0CTL1 |= UCTXSTP;
-  uint16_t retries = RETRY_COUNT;
-  while ((UCB0CTL1 & UCTXSTP) && --retries) {
+static bool i2c_recover_bus(void) {
+  UCB0CTL1 |= UCSWRST;
+  i2c_release_line(IO_I2C_SCL);
+  i2c_release_line(IO_I2C_SDA);
+  io_set_select(IO_I2C_SCL, IO_SELECT_GPIO);
+  io_set_select(IO_I2C_SDA, IO_SELECT_GPIO);
+  i2c_half_bit_delay();
+
+  for (uint8_t i = 0; i < I2C_RECOVERY_CLOCK_PULSES; i++) {
+    if (i2c_line_released(IO_I2C_SDA)) {
+      break;
+    }
+    i2c_pull_line(IO_I2C_SCL);
+    i2c_half_bit_delay();
+    i2c_release_line(IO_I2C_SCL);
+    i2c_half_bit_delay();
   }
-  if (retries == 0) {
-    return I2C_RESULT_ERROR_TIMEOUT;
+
+  // Stop condition (SDA rising while SCL is high) resets the slave state
+  i2c_pull_line(IO_I2C_SCL);
+  i2c_half_bit_delay();
+  i2c_pull_line(IO_I2C_SDA);
+  i2c_half_bit_delay();
+  i2c_release_line(IO_I2C_SCL);
+  i2c_half_bit_delay();
+  i2c_release_line(IO_I2C_SDA);
+  i2c_half_bit_delay();
+  const bool recovered = !i2c_bus_stuck();
+
+  // Back to the pin config expected by i2c_init
+  io_set_direction(IO_I2C_SCL, IO_DIR_OUTPUT);
+  io_set_direction(IO_I2C_SDA, IO_DIR_OUTPUT);
+  io_set_select(IO_I2C_SCL, IO_SELECT_ALT1);
+  io_set_select(IO_I2C_SDA, IO_SELECT_ALT1);
+  i2c_configure(current_speed);
+
+  i2c_stats_record_recovery(recovered);
+  return recovered;
+}
+
+// Deadline of the ongoing transaction has passed (timer interrupt)
+static void i2c_timeout_isr(void) {
+  if (queue_head == NULL || queue_head->status != I2C_STATUS_ONGOING) {
+    return;
+  }
+  queue_head->timeout = i2c_timeout_reason();
+  // Resetting the module releases the bus, unless a slave is holding it
+  i2c_configure(current_speed);
+  if (i2c_bus_stuck()) {
+    i2c_recover_bus();
+  }
+  i2c_finish_transaction(I2C_RESULT_ERROR_TIMEOUT);
+}
+
+INTERRUPT_FUNCTION(USCI_B0_VECTOR) isr_usci_b0(void) {
+  // Reading UCB0IV clears the corresponding flag
+  switch (__even_in_range(UCB0IV, USCI_I2C_UCTXIFG)) {
+  case USCI_I2C_UCNACKIFG:
+    i2c_handle_nack();
+    break;
+  case USCI_I2C_UCRXIFG:
+    i2c_handle_rx();
+    break;
+  case USCI_I2C_UCTXIFG:
+    i2c_handle_tx();
+    break;
+  default:
+    break;
   }
-  return (UCB0STAT & UCNACKIFG) ? I2C_RESULT_ERROR_STOP : I2C_RESULT_OK;
+}
+
+void i2c_submit(struct i2c_transaction *transaction) {
+  ASSERT(transaction);
+  ASSERT(transaction->addr);
+  ASSERT(transaction->addr_size > 0);
+  ASSERT(transaction->data_size > 0);
+  ASSERT(transaction->dir == I2C_DIR_WRITE ? transaction->tx_data != NULL
+                                           : transaction->rx_data != NULL);
+  ASSERT(transaction->speed < I2C_SPEED_COUNT);
+  ASSERT(transaction->status != I2C_STATUS_QUEUED &&
+         transaction->status != I2C_STATUS_ONGOING);
+
+  transaction->status = I2C_STATUS_QUEUED;
+  transaction->next = NULL;
+
+  CRITICAL_SECTION_ENTER();
+  if (queue_tail) {
+    queue_tail->next = transaction;
+    queue_tail = transaction;
+  } else {
+    queue_head = transaction;
+    queue_tail = transaction;
+    i2c_start_transaction(transaction);
+  }
+  CRITICAL_SECTION_EXIT();
+}
+
+bool i2c_idle(void) { return queue_head == NULL; }
+
+bool i2c_bus_recover(void) {
+  ASSERT(i2c_idle());
+  CRITICAL_SECTION_ENTER();
+  const bool recovered = i2c_recover_bus();
+  CRITICAL_SECTION_EXIT();
+  return recovered;
+}
+
+/* The transaction completes in the interrupt, at the latest when its deadline
+ * passes, so the wait is bounded by the deadlines of the transactions ahead of
+ * it in the queue and its own. */
+static i2c_result_e i2c_wait_transaction(struct i2c_transaction *transaction) {
+  ASSERT(__get_SR_register() & GIE);
+  while (transaction->status != I2C_STATUS_DONE) {
+  }
+  last_timeout = transaction->timeout;
+  return transaction->result;
 }
 
 i2c_result_e i2c_write(const uint8_t *addr, uint8_t addr_size,
@@ -113,22 +621,17 @@ i2c_result_e i2c_write(const uint8_t *addr, uint8_t addr_size,
   ASSERT(data);
   ASSERT(data_size > 0);
 
-  i2c_result_e result = i2c_start_tx_transfer(addr, addr_size);
-  if (result) {
-    return result;
-  }
-
-  // Send from most to least significant byte
-  for (uint16_t i = 0; i < data_size; i++) {
-    i2c_set_tx_byte(data[i]);
-    result = i2c_wait_tx_byte();
-    if (result) {
-      return result;
-    }
-  }
-
-  result = i2c_stop_transfer();
-  return result;
+  struct i2c_transaction transaction = {
+      .slave_addr = slave_address,
+      .speed = speed_blocking,
+      .dir = I2C_DIR_WRITE,
+      .addr = addr,
+      .addr_size = addr_size,
+      .tx_data = data,
+      .data_size = data_size,
+  };
+  i2c_submit(&transaction);
+  return i2c_wait_transaction(&transaction);
 }
 
 i2c_result_e i2c_read(const uint8_t *addr, uint8_t addr_size, uint8_t *data,
@@ -138,32 +641,17 @@ i2c_result_e i2c_read(const uint8_t *addr, uint8_t addr_size, uint8_t *data,
   ASSERT(data);
   ASSERT(data_size > 0);
 
-  i2c_result_e result = i2c_start_rx_transfer(addr, addr_size);
-  if (result) {
-    return result;
-  }
-
-  // Read bytes from most to least significant byte
-  for (uint16_t i = data_size - 1; 1 <= i; i--) {
-    result = i2c_wait_rx_byte();
-    if (result) {
-      return result;
-    }
-    data[i] = i2c_get_rx_byte();
-  }
-
-  // Must stop before last byte
-  result = i2c_stop_transfer();
-  if (result) {
-    return result;
-  }
-  result = i2c_wait_rx_byte();
-  if (result) {
-    return result;
-  }
-  data[0] = i2c_get_rx_byte();
-
-  return I2C_RESULT_OK;
+  struct i2c_transaction transaction = {
+      .slave_addr = slave_address,
+      .speed = speed_blocking,
+      .dir = I2C_DIR_READ,
+      .addr = addr,
+      .addr_size = addr_size,
+      .rx_data = data,
+      .data_size = data_size,
+  };
+  i2c_submit(&transaction);
+  return i2c_wait_transaction(&transaction);
 }
 
 i2c_result_e i2c_read_addr8_data8(uint8_t addr, uint8_t *data) {
@@ -182,7 +670,135 @@ i2c_result_e i2c_write_addr8_data8(uint8_t addr, uint8_t data) {
   return i2c_write(&addr, 1, &data, 1);
 }
 
-void i2c_set_slave_address(uint8_t addr) { UCB0I2CSA = addr; }
+i2c_result_e i2c_write_addr8_data16(uint8_t addr, uint16_t data) {
+  const uint8_t bytes[] = {data >> 8, data & 0xFF};
+  return i2c_write(&addr, 1, bytes, sizeof(bytes));
+}
+
+i2c_result_e i2c_write_addr8_data32(uint8_t addr, uint32_t data) {
+  const uint8_t bytes[] = {data >> 24, (data >> 16) & 0xFF, (data >> 8) & 0xFF,
+                           data & 0xFF};
+  return i2c_write(&addr, 1, bytes, sizeof(bytes));
+}
+
+i2c_result_e i2c_write_burst(uint8_t addr, const uint8_t *data,
+                             uint8_t data_size) {
+  return i2c_write(&addr, 1, data, data_size);
+}
+
+// Longest burst a script write is merged into (stack buffer)
+#define I2C_SCRIPT_BURST_MAX (16u)
+
+static inline bool i2c_script_is_write(const struct i2c_script_op *op) {
+  return op->op == I2C_SCRIPT_OP_WRITE || op->op == I2C_SCRIPT_OP_WRITE_VAR;
+}
+
+static inline uint8_t i2c_script_write_value(const struct i2c_script_op *op,
+                                             const uint8_t *vars) {
+  return op->op == I2C_SCRIPT_OP_WRITE_VAR ? vars[op->value] : op->value;
+}
+
+/* Writes ops[0] and any following writes to contiguous registers as one burst.
+ * A burst ends at register 0xFF, it's never assumed that the auto-increment
+ * wraps to 0x00 (e.g. 0xFF is the page select of the VL53L0X, which is
+ * written right before 0x00 in its scripts). */
+static i2c_result_e i2c_script_write(const struct i2c_script_op *ops,
+                                     uint8_t count, const uint8_t *vars,
+                                     uint8_t *written) {
+  uint8_t burst[I2C_SCRIPT_BURST_MAX];
+  uint8_t length = 0;
+  do {
+    burst[length] = i2c_script_write_value(&ops[length], vars);
+    length++;
+  } while (length < count && length < I2C_SCRIPT_BURST_MAX &&
+           i2c_script_is_write(&ops[length]) &&
+           ops[length - 1].reg != 0xFF &&
+           ops[length].reg == ops[length - 1].reg + 1);
+  *written = length;
+  return i2c_write_burst(ops[0].reg, burst, length);
+}
+
+static i2c_result_e i2c_script_rmw(const struct i2c_script_op *op,
+                                   const uint8_t *vars) {
+  uint8_t data = 0;
+  const i2c_result_e result = i2c_read_addr8_data8(op->reg, &data);
+  if (result) {
+    return result;
+  }
+  const uint8_t value =
+      op->op == I2C_SCRIPT_OP_RMW_VAR ? vars[op->value] : op->value;
+  return i2c_write_addr8_data8(op->reg, (data & ~op->mask) | value);
+}
+
+static i2c_result_e i2c_script_poll(const struct i2c_script_op *op) {
+  const bool until_set = op->op == I2C_SCRIPT_OP_POLL_SET;
+  const uint32_t timeout_us = op->value * 1000ul;
+  const uint32_t start_us = timestamp_us();
+  for (;;) {
+    uint8_t data = 0;
+    const i2c_result_e result = i2c_read_addr8_data8(op->reg, &data);
+    if (result) {
+      return result;
+    }
+    if (((data & op->mask) != 0) == until_set) {
+      return I2C_RESULT_OK;
+    }
+    if (timestamp_elapsed_us(start_us) > timeout_us) {
+      return I2C_RESULT_ERROR_TIMEOUT;
+    }
+  }
+}
+
+static void i2c_script_delay(uint8_t ms) {
+  const uint32_t start_us = timestamp_us();
+  while (timestamp_elapsed_us(start_us) < ms * 1000ul) {
+  }
+}
+
+i2c_result_e i2c_script_run(const struct i2c_script_op *ops, uint8_t count,
+                            uint8_t *vars) {
+  ASSERT(ops);
+  i2c_result_e result = I2C_RESULT_OK;
+  uint8_t i = 0;
+  while (i < count && result == I2C_RESULT_OK) {
+    const struct i2c_script_op *op = &ops[i];
+    uint8_t step = 1;
+    switch (op->op) {
+    case I2C_SCRIPT_OP_WRITE:
+    case I2C_SCRIPT_OP_WRITE_VAR:
+      ASSERT(vars || op->op == I2C_SCRIPT_OP_WRITE);
+      result = i2c_script_write(op, count - i, vars, &step);
+      break;
+    case I2C_SCRIPT_OP_READ_VAR:
+      ASSERT(vars);
+      result = i2c_read_addr8_data8(op->reg, &vars[op->value]);
+      break;
+    case I2C_SCRIPT_OP_RMW:
+    case I2C_SCRIPT_OP_RMW_VAR:
+      ASSERT(vars || op->op == I2C_SCRIPT_OP_RMW);
+      result = i2c_script_rmw(op, vars);
+      break;
+    case I2C_SCRIPT_OP_POLL_SET:
+    case I2C_SCRIPT_OP_POLL_CLEAR:
+      result = i2c_script_poll(op);
+      break;
+    case I2C_SCRIPT_OP_DELAY:
+      i2c_script_delay(op->value);
+      break;
+    }
+    i += step;
+  }
+  return result;
+}
+
+void i2c_set_slave_address(uint8_t addr) { slave_address = addr; }
+
+void i2c_set_speed(i2c_speed_e speed) {
+  ASSERT(speed < I2C_SPEED_COUNT);
+  speed_blocking = speed;
+}
+
+i2c_timeout_e i2c_last_timeout(void) { return last_timeout; }
 
 static bool initialized = false;
 
@@ -201,21 +817,13 @@ void i2c_init(void) {
   io_get_current_config(IO_I2C_SDA, &current_config);
   ASSERT(io_config_compare(&i2c_config, &current_config));
 
-  // Must set reset while configuring
-  UCB0CTL1 |= UCSWRST;
-
-  // Single master, synchronous mode, I2C mode
-  UCB0CTL0 = UCMST + UCSYNC + UCMODE_3;
-
-  // SMCLK
-  UCB0CTL1 |= UCSSEL_2;
-
-  // SMCLK/160 ~= 100kHz
-  UCB0BR0 = 160;
-  UCB0BR1 = 0;
-
-  // Clear reset
-  UCB0CTL1 &= ~UCSWRST;
+  dma_channel_init(DMA_CHANNEL_I2C_RX, DMA_TRIGGER_UCB0RXIFG, i2c_rx_dma_done);
+  dma_channel_init(DMA_CHANNEL_I2C_TX, DMA_TRIGGER_UCB0TXIFG, i2c_tx_dma_done);
+  i2c_configure(I2C_SPEED_STANDARD);
+  // A slave may still be in the middle of a read from before a reset
+  if (i2c_bus_stuck()) {
+    i2c_recover_bus();
+  }
 
   initialized = true;
 }
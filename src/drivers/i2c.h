@@ -1,9 +1,16 @@
 #ifndef I2C_H
 #define I2C_H
 
+#include "drivers/io.h"
+#include <stdbool.h>
 #include <stdint.h>
 
-// Polling based I2C master driver
+/* Interrupt driven I2C master driver. Transactions are described by
+ * caller-owned descriptors that are queued and executed in the background by
+ * the USCI_B0 interrupt, so the CPU is free while bytes are on the bus. Longer
+ * data phases (burst register reads/writes) are moved by DMA. The blocking
+ * functions further down are wrappers that submit a transaction and wait for
+ * it to complete. */
 
 typedef enum {
   I2C_RESULT_OK,
@@ -12,11 +19,107 @@ typedef enum {
   I2C_RESULT_ERROR_RX,
   I2C_RESULT_ERROR_STOP,
   I2C_RESULT_ERROR_TIMEOUT,
+  I2C_RESULT_COUNT
 } i2c_result_e;
 
+/* Bus speed, selected per transaction (so per device). The prescalers are
+ * derived from SMCLK and checked at compile time. Override
+ * I2C_SPEED_CUSTOM_HZ at build time to use a different custom speed. */
+typedef enum {
+  I2C_SPEED_STANDARD, // 100 kHz (default)
+  I2C_SPEED_FAST,     // 400 kHz
+  I2C_SPEED_CUSTOM,   // I2C_SPEED_CUSTOM_HZ
+  I2C_SPEED_COUNT
+} i2c_speed_e;
+
+#define I2C_SPEED_STANDARD_HZ (100000u)
+#define I2C_SPEED_FAST_HZ (400000u)
+#ifndef I2C_SPEED_CUSTOM_HZ
+#define I2C_SPEED_CUSTOM_HZ (250000u)
+#endif
+
+typedef enum {
+  I2C_DIR_WRITE,
+  I2C_DIR_READ,
+} i2c_dir_e;
+
+// Where a transaction was when it timed out
+typedef enum {
+  I2C_TIMEOUT_NONE,
+  I2C_TIMEOUT_BUS_BUSY, // Bus never became idle, start condition not sent
+  I2C_TIMEOUT_START,    // Slave address not acknowledged (clock stretched)
+  I2C_TIMEOUT_TX,       // Stalled while sending
+  I2C_TIMEOUT_RX,       // Stalled while receiving
+} i2c_timeout_e;
+
+typedef enum {
+  I2C_STATUS_IDLE,    // Never submitted
+  I2C_STATUS_QUEUED,  // Waiting for the bus
+  I2C_STATUS_ONGOING, // On the bus
+  I2C_STATUS_DONE,    // Finished, result is valid
+} i2c_status_e;
+
+struct i2c_transaction;
+
+// Called from interrupt context when a transaction is done
+typedef void (*i2c_callback)(struct i2c_transaction *transaction);
+
+struct i2c_transaction {
+  uint8_t slave_addr;
+  i2c_speed_e speed;
+  i2c_dir_e dir;
+  // Register address, sent from index 0 and up
+  const uint8_t *addr;
+  uint8_t addr_size;
+  // Write data is sent from index 0 and up
+  const uint8_t *tx_data;
+  // Read data is stored from most to least significant byte (see i2c_read)
+  uint8_t *rx_data;
+  uint8_t data_size;
+  i2c_callback callback; // Optional
+  /* Max time on the bus (not counting time in the queue) before it's aborted
+   * with I2C_RESULT_ERROR_TIMEOUT. 0 means the default, which is twice the
+   * transfer time at the selected speed plus a margin. */
+  uint16_t timeout_us;
+
+  // Owned by the driver while the transaction is queued or ongoing
+  volatile i2c_status_e status;
+  volatile i2c_result_e result;
+  i2c_timeout_e timeout;
+  uint16_t duration_us; // Time on the bus
+  struct i2c_transaction *next;
+};
+
 void i2c_init(void);
 
+/* Queue a transaction. It starts right away if the bus is idle. The
+ * descriptor (and the buffers it points to) must stay valid until its status
+ * is I2C_STATUS_DONE. */
+void i2c_submit(struct i2c_transaction *transaction);
+
+// True if no transaction is ongoing or queued
+bool i2c_idle(void);
+
+/* A slave can hold SDA low forever if it lost clock pulses in the middle of a
+ * read (e.g. brownout or EMI). The driver checks the lines after a timeout
+ * (and at init) and if they are held low it clocks SCL manually until the
+ * slave lets go, sends a stop condition and resets USCI_B0 (~100 us). This
+ * runs the same recovery on demand, the bus must be idle. Returns true if
+ * both lines are released afterwards. */
+bool i2c_bus_recover(void);
+
+/* How the driver reads SCL and SDA when checking the bus (and while
+ * recovering it, with the pins as GPIO). Weak, so a test can fake a slave
+ * holding the bus. */
+bool i2c_line_released(io_e io);
+
+/* Blocking interface, uses the slave address and speed set by
+ * i2c_set_slave_address and i2c_set_speed. Must be called with interrupts
+ * enabled. */
 void i2c_set_slave_address(uint8_t addr);
+void i2c_set_speed(i2c_speed_e speed);
+// Where the last blocking transaction timed out (or I2C_TIMEOUT_NONE)
+i2c_timeout_e i2c_last_timeout(void);
 
 // These functions send data in order from most to least significant byte
 i2c_result_e i2c_write(const uint8_t *addr, uint8_t addr_size,
@@ -30,5 +133,90 @@ i2c_result_e i2c_read_addr8_data8(uint8_t addr, uint8_t *data);
 i2c_result_e i2c_read_addr8_data16(uint8_t addr, uint16_t *data);
 i2c_result_e i2c_read_addr8_data32(uint8_t addr, uint32_t *data);
 i2c_result_e i2c_write_addr8_data8(uint8_t addr, uint8_t data);
+i2c_result_e i2c_write_addr8_data16(uint8_t addr, uint16_t data);
+i2c_result_e i2c_write_addr8_data32(uint8_t addr, uint32_t data);
+
+/* Bus statistics, kept by the interrupt when a transaction completes. The
+ * latency histogram is per slave address and has log2 bins of the time on the
+ * bus: bin 0 counts transactions shorter than 2 us and bin n those that took
+ * [2^n, 2^(n + 1)) us. Define DISABLE_I2C_STATS to compile it all out. */
+#ifndef DISABLE_I2C_STATS
+#define I2C_STATS_SLAVE_COUNT (8u)
+#define I2C_STATS_HISTOGRAM_BINS (16u)
+
+struct i2c_slave_stats {
+  uint8_t slave_addr; // 0 if unused
+  uint16_t histogram[I2C_STATS_HISTOGRAM_BINS]; // Saturating counts
+};
+
+struct i2c_stats {
+  uint32_t transactions;
+  uint32_t bytes; // Register address and data bytes of successful ones
+  uint32_t busy_us;
+  uint16_t results[I2C_RESULT_COUNT]; // Completed transactions per result
+  uint16_t untracked; // Transactions to slaves that didn't fit in the table
+  uint16_t bus_stuck; // Times SDA or SCL was held low after a timeout
+  uint16_t bus_recovered; // Times the bus was free again after recovery
+  // Stop conditions that weren't sent in time, USCI_B0 was reset instead
+  uint16_t stop_timeouts;
+  struct i2c_slave_stats slaves[I2C_STATS_SLAVE_COUNT];
+};
+
+void i2c_stats_get(struct i2c_stats *stats);
+void i2c_stats_reset(void);
+void i2c_stats_trace(void);
+#else
+#define i2c_stats_reset() ;
+#define i2c_stats_trace() ;
+#endif
+
+/* Writes data[0] to register addr, data[1] to addr + 1 and so on in a single
+ * transaction (relies on the slave auto-incrementing the register address) */
+i2c_result_e i2c_write_burst(uint8_t addr, const uint8_t *data,
+                             uint8_t data_size);
+
+/* Register scripts are const tables of operations on the 8-bit registers of
+ * the slave set by i2c_set_slave_address. Writes to contiguous registers that
+ * follow each other in the script are merged into a single burst (never
+ * across 0xFF to 0x00), so a long init sequence takes a handful of
+ * transactions. */
+typedef enum {
+  I2C_SCRIPT_OP_WRITE,      // reg = value
+  I2C_SCRIPT_OP_WRITE_VAR,  // reg = vars[value]
+  I2C_SCRIPT_OP_READ_VAR,   // vars[value] = reg
+  I2C_SCRIPT_OP_RMW,        // reg = (reg & ~mask) | value
+  I2C_SCRIPT_OP_RMW_VAR,    // reg = (reg & ~mask) | vars[value]
+  I2C_SCRIPT_OP_POLL_SET,   // Until (reg & mask) != 0, value is timeout in ms
+  I2C_SCRIPT_OP_POLL_CLEAR, // Until (reg & mask) == 0, value is timeout in ms
+  I2C_SCRIPT_OP_DELAY,      // Wait value ms
+} i2c_script_op_e;
+
+struct i2c_script_op {
+  i2c_script_op_e op;
+  uint8_t reg;
+  uint8_t mask;
+  uint8_t value;
+};
+
+#define I2C_WRITE(r, v) {.op = I2C_SCRIPT_OP_WRITE, .reg = (r), .value = (v)}
+#define I2C_WRITE_VAR(r, var)                                                  \
+  {.op = I2C_SCRIPT_OP_WRITE_VAR, .reg = (r), .value = (var)}
+#define I2C_READ_VAR(r, var)                                                   \
+  {.op = I2C_SCRIPT_OP_READ_VAR, .reg = (r), .value = (var)}
+#define I2C_RMW(r, m, v)                                                       \
+  {.op = I2C_SCRIPT_OP_RMW, .reg = (r), .mask = (m), .value = (v)}
+#define I2C_RMW_VAR(r, m, var)                                                 \
+  {.op = I2C_SCRIPT_OP_RMW_VAR, .reg = (r), .mask = (m), .value = (var)}
+#define I2C_POLL_SET(r, m, ms)                                                 \
+  {.op = I2C_SCRIPT_OP_POLL_SET, .reg = (r), .mask = (m), .value = (ms)}
+#define I2C_POLL_CLEAR(r, m, ms)                                               \
+  {.op = I2C_SCRIPT_OP_POLL_CLEAR, .reg = (r), .mask = (m), .value = (ms)}
+#define I2C_DELAY(ms) {.op = I2C_SCRIPT_OP_DELAY, .value = (ms)}
+
+/* Runs the script (blocking) and stops at the first error. A poll that times
+ * out gives I2C_RESULT_ERROR_TIMEOUT. vars may be NULL if the script has no
+ * *_VAR operations. */
+i2c_result_e i2c_script_run(const struct i2c_script_op *ops, uint8_t count,
+                            uint8_t *vars);
 
 #endif // I2C_H
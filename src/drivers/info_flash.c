@@ -0,0 +1,80 @@
+#include "drivers/info_flash.h"
+#include "common/assert_handler.h"
+#include "common/defines.h"
+#include <assert.h>
+#include <msp430.h>
+#include <stddef.h>
+
+/* Record layout: header followed by the data. The header is written last, so
+ * a record is never seen as valid if the write was interrupted. Erased flash
+ * reads 0xFF, which is never a valid size. */
+struct info_flash_header {
+  uint8_t size;
+  uint8_t reserved;
+  uint16_t crc; // Over size and data
+};
+static_assert(sizeof(struct info_flash_header) == INFO_FLASH_HEADER_SIZE,
+              "Unexpected header size");
+static_assert(INFO_FLASH_DATA_MAX_SIZE < 0xFF, "Size must fit in the header");
+
+// See the memory map in the MSP430F5529 datasheet
+static const uint16_t segment_addrs[INFO_FLASH_SEGMENT_COUNT] = {
+    [INFO_FLASH_SEGMENT_VL53L0X] = 0x1800,
+};
+
+// CRC-CCITT with the CRC16 module
+static uint16_t info_flash_crc(const uint8_t *data, uint8_t size) {
+  CRCINIRES = 0xFFFF;
+  CRCDI_L = size;
+  for (uint8_t i = 0; i < size; i++) {
+    CRCDI_L = data[i];
+  }
+  return CRCINIRES;
+}
+
+bool info_flash_load(info_flash_segment_e segment, void *data, uint8_t size) {
+  ASSERT(segment < INFO_FLASH_SEGMENT_COUNT);
+  ASSERT(size <= INFO_FLASH_DATA_MAX_SIZE);
+  const struct info_flash_header *header =
+      (const struct info_flash_header *)segment_addrs[segment];
+  const uint8_t *stored = (const uint8_t *)(header + 1);
+  if (header->size != size || header->crc != info_flash_crc(stored, size)) {
+    return false;
+  }
+  for (uint8_t i = 0; i < size; i++) {
+    ((uint8_t *)data)[i] = stored[i];
+  }
+  return true;
+}
+
+static void info_flash_write_bytes(uint8_t *dst, const uint8_t *src,
+                                   uint8_t size) {
+  for (uint8_t i = 0; i < size; i++) {
+    dst[i] = src[i];
+    while (FCTL3 & BUSY) {
+    }
+  }
+}
+
+void info_flash_store(info_flash_segment_e segment, const void *data,
+                      uint8_t size) {
+  ASSERT(segment < INFO_FLASH_SEGMENT_COUNT);
+  ASSERT(size <= INFO_FLASH_DATA_MAX_SIZE);
+  const struct info_flash_header header = {
+      .size = size, .reserved = 0xFF, .crc = info_flash_crc(data, size)};
+  uint8_t *dst = (uint8_t *)segment_addrs[segment];
+
+  // The flash must not be accessed (e.g. by an interrupt) while programmed
+  CRITICAL_SECTION_ENTER();
+  FCTL3 = FWKEY; // Unlock
+  FCTL1 = FWKEY + ERASE;
+  *dst = 0; // Dummy write starts the segment erase
+  while (FCTL3 & BUSY) {
+  }
+  FCTL1 = FWKEY + WRT;
+  info_flash_write_bytes(dst + sizeof(header), data, size);
+  info_flash_write_bytes(dst, (const uint8_t *)&header, sizeof(header));
+  FCTL1 = FWKEY;
+  FCTL3 = FWKEY + LOCK;
+  CRITICAL_SECTION_EXIT();
+}
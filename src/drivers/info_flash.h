@@ -0,0 +1,34 @@
+#ifndef INFO_FLASH_H
+#define INFO_FLASH_H
+
+/* Driver for storing data that should survive a reset (e.g. calibration) in
+ * the information memory of the flash. Each record is checked with a CRC, so a
+ * segment that was never written (or interrupted while written) isn't loaded.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Each segment (128 bytes) has a single owner, which is assigned here to catch
+ * two drivers claiming the same segment. Info A is left alone since it's
+ * locked separately and may hold calibration data of TI. */
+typedef enum {
+  INFO_FLASH_SEGMENT_VL53L0X, // Info D
+  INFO_FLASH_SEGMENT_COUNT
+} info_flash_segment_e;
+
+#define INFO_FLASH_SEGMENT_SIZE (128u)
+#define INFO_FLASH_HEADER_SIZE (4u)
+#define INFO_FLASH_DATA_MAX_SIZE                                               \
+  (INFO_FLASH_SEGMENT_SIZE - INFO_FLASH_HEADER_SIZE)
+
+/* Copies the record of the segment to data if it's valid (has the same size
+ * and a matching CRC), else leaves data untouched and returns false. */
+bool info_flash_load(info_flash_segment_e segment, void *data, uint8_t size);
+
+/* Erases the segment and writes data to it. Blocks (with interrupts disabled)
+ * for the erase (~25 ms) and write, so don't call it when timing matters. */
+void info_flash_store(info_flash_segment_e segment, const void *data,
+                      uint8_t size);
+
+#endif // INFO_FLASH_H
@@ -152,6 +152,8 @@ static const struct io_config
                                        IO_DIR_INPUT, IO_OUT_LOW},
         [IO_LINE_DETECT_BACK_LEFT] = {IO_SELECT_GPIO, IO_PUPD_DISABLED,
                                       IO_DIR_INPUT, IO_OUT_LOW},
+        [IO_BATTERY_VOLTAGE] = {IO_SELECT_GPIO, IO_PUPD_DISABLED, IO_DIR_INPUT,
+                                IO_OUT_LOW},
 
         [IO_XSHUT_FRONT] = {IO_SELECT_GPIO, IO_PUPD_DISABLED, IO_DIR_OUTPUT,
                             IO_OUT_LOW},
@@ -173,7 +175,6 @@ static const struct io_config
         // Unused pins
         [IO_UNUSED_1] = UNUSED_CONFIG,
         [IO_UNUSED_2] = UNUSED_CONFIG,
-        [IO_UNUSED_3] = UNUSED_CONFIG,
         [IO_UNUSED_7] = UNUSED_CONFIG,
         [IO_UNUSED_8] = UNUSED_CONFIG,
         [IO_UNUSED_9] = UNUSED_CONFIG,
@@ -185,6 +186,7 @@ static const struct io_config
         [IO_UNUSED_16] = UNUSED_CONFIG,
         [IO_UNUSED_17] = UNUSED_CONFIG,
         [IO_UNUSED_18] = UNUSED_CONFIG,
+        [IO_UNUSED_19] = UNUSED_CONFIG,
         [IO_UNUSED_23] = UNUSED_CONFIG,
         [IO_UNUSED_24] = UNUSED_CONFIG,
         [IO_UNUSED_25] = UNUSED_CONFIG,
@@ -198,7 +200,6 @@ static const struct io_config
         [IO_UNUSED_33] = UNUSED_CONFIG,
         [IO_UNUSED_34] = UNUSED_CONFIG,
 
-        [IO_UNUSED_38] = UNUSED_CONFIG,
         [IO_UNUSED_39] = UNUSED_CONFIG,
         [IO_UNUSED_40] = UNUSED_CONFIG,
         [IO_UNUSED_41] = UNUSED_CONFIG,
@@ -223,14 +224,13 @@ static const struct io_config
 #endif
 };
 
+// In ADC channel order (A0 and up), see adc.c
 static const io_e io_adc_pins_arr[] = {
     IO_LINE_DETECT_FRONT_LEFT,
-    /*#if defined(NSUMO)
-            IO_LINE_DETECT_BACK_LEFT,
-            IO_LINE_DETECT_FRONT_RIGHT,
-            IO_LINE_DETECT_BACK_RIGHT
-    #endif */
-
+    IO_LINE_DETECT_FRONT_RIGHT,
+    IO_LINE_DETECT_BACK_RIGHT,
+    IO_LINE_DETECT_BACK_LEFT,
+    IO_BATTERY_VOLTAGE,
 };
 
 void io_init(void) {
@@ -408,6 +408,8 @@ static void io_register_isr(io_e io, isr_function isr) {
 }
 
 void io_configure_interrupt(io_e io, io_trigger_e trigger, isr_function isr) {
+  // Only port 1 and 2 have interrupts
+  ASSERT(io_port(io) < IO_INTERRUPT_PORT_CNT);
   io_set_interrupt_trigger(io, trigger);
   io_register_isr(io, isr);
 }
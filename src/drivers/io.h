@@ -90,7 +90,8 @@ typedef enum {
   IO_TEST_LED = IO_10,
   IO_UNUSED_1 = IO_11,
   IO_UNUSED_2 = IO_12,
-  IO_UNUSED_3 = IO_13,
+  // GPIO1 of the range sensors, must be on port 1 or 2 (interrupt capable)
+  IO_RANGE_SENSOR_FRONT_INT = IO_13,
   IO_PWM_MOTORS_LEFT = IO_14,
   IO_PWM_MOTORS_RIGHT = IO_15,
   IO_MOTORS_RIGHT_CC_1 = IO_16,
@@ -111,7 +112,7 @@ typedef enum {
   IO_UNUSED_17 = IO_35,
   IO_UNUSED_18 = IO_36,
   IO_MOTORS_LEFT_CC_1 = IO_37,
-  IO_RANGE_SENSOR_FRONT_INT = IO_40,
+  IO_UNUSED_19 = IO_40,
   IO_I2C_SDA = IO_41,
   IO_I2C_SCL = IO_42,
   IO_XSHUT_FRONT = IO_43,
@@ -132,7 +133,7 @@ typedef enum {
   IO_LINE_DETECT_FRONT_RIGHT = IO_61,
   IO_LINE_DETECT_BACK_RIGHT = IO_62,
   IO_LINE_DETECT_BACK_LEFT = IO_63,
-  IO_UNUSED_38 = IO_64,
+  IO_BATTERY_VOLTAGE = IO_64,
   IO_UNUSED_39 = IO_65,
   IO_UNUSED_40 = IO_66,
   IO_UNUSED_41 = IO_67,
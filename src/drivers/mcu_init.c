@@ -2,6 +2,7 @@
 #include "common/assert_handler.h"
 #include "common/defines.h"
 #include "drivers/io.h"
+#include "drivers/timestamp.h"
 #include <msp430.h>
 
 void SetVcoreUp(unsigned int level);
@@ -93,6 +94,9 @@ void mcu_init(void) {
   // Initializes Input/Output
   io_init();
 
+  // Initializes the microsecond timebase
+  timestamp_init();
+
   // Enables the Interrupt globally
   _enable_interrupts();
 }
@@ -1,6 +1,7 @@
 #include "drivers/pwm.h"
 #include "common/assert_handler.h"
 #include "common/defines.h"
+#include "drivers/battery.h"
 #include "drivers/io.h"
 #include <assert.h>
 #include <msp430.h>
@@ -80,13 +81,50 @@ static void pwm_channel_enable(pwm_e pwm, bool enable) {
   }
 }
 
+/* The motors are rated 6V and the battery is ~8V when fully charged, so the
+ * duty cycle is scaled down by the ratio of the two to keep the effective
+ * motor voltage at 6V as the battery discharges. Before the battery is
+ * measured (e.g. the ADC isn't sampling), it's assumed fully charged. */
+#define PWM_MOTOR_RATED_MV (6000u)
+#define PWM_BATTERY_DEFAULT_MV (8000u)
+#define PWM_SCALE_ONE (1u << 8) // Q8 fixed point
+
+/* The stall current of the motors can pull a low battery down far enough to
+ * brown out the regulator (resetting the MCU and the range sensors), so the
+ * duty cycle is capped from PWM_BROWNOUT_START_MV, linearly down to
+ * PWM_BROWNOUT_MIN_DUTY at PWM_BROWNOUT_END_MV (~3.0V per cell). */
+#define PWM_BROWNOUT_START_MV (6600u)
+#define PWM_BROWNOUT_END_MV (6000u)
+#define PWM_BROWNOUT_MIN_DUTY (40u)
+
+static uint8_t pwm_brownout_cap(uint16_t battery_mv) {
+  if (battery_mv >= PWM_BROWNOUT_START_MV) {
+    return 100;
+  }
+  if (battery_mv <= PWM_BROWNOUT_END_MV) {
+    return PWM_BROWNOUT_MIN_DUTY;
+  }
+  return PWM_BROWNOUT_MIN_DUTY +
+         ((uint32_t)(battery_mv - PWM_BROWNOUT_END_MV) *
+          (100 - PWM_BROWNOUT_MIN_DUTY)) /
+             (PWM_BROWNOUT_START_MV - PWM_BROWNOUT_END_MV);
+}
+
 static inline uint8_t pwm_scale_duty_cycle(uint8_t duty_cycle_percent) {
-  /* Battery is at ~8V when fully charged and the motors are 6v max,
-   * so scale dowm the duty cycle by 25% to be within specs. This
-   * should never return 0.
-   */
-  return duty_cycle_percent == 1 ? duty_cycle_percent
-                                 : duty_cycle_percent * 3 / 4;
+  uint16_t battery_mv = PWM_BATTERY_DEFAULT_MV;
+  battery_get_voltage_mv(&battery_mv); // Untouched if not measured yet
+  // Not above one, the duty cycle can't make up for a battery below 6V
+  uint16_t scale = PWM_SCALE_ONE;
+  if (battery_mv > PWM_MOTOR_RATED_MV) {
+    scale = ((uint32_t)PWM_MOTOR_RATED_MV * PWM_SCALE_ONE) / battery_mv;
+  }
+  uint8_t scaled = ((uint16_t)duty_cycle_percent * scale) >> 8;
+  const uint8_t cap = pwm_brownout_cap(battery_mv);
+  if (scaled > cap) {
+    scaled = cap;
+  }
+  // This should never return 0 (it would disable the channel)
+  return scaled ? scaled : 1;
 }
 
 void pwm_set_duty_cycle(pwm_e pwm, uint8_t duty_cycle_percent) {
@@ -125,5 +163,7 @@ void pwm_init(void) {
   // Set period
   TA0CCR0 = PWM_TA0CCR0;
 
+  battery_init();
+
   initialized = true;
 }
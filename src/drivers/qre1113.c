@@ -4,8 +4,23 @@
 #include "drivers/adc.h"
 #include "drivers/io.h"
 #include <stdbool.h>
+#include <stddef.h>
 
 static bool initialized = false;
+static qre1113_crossing_function crossing_function = NULL;
+
+static const io_e sensor_ios[] = {
+    IO_LINE_DETECT_FRONT_LEFT, IO_LINE_DETECT_FRONT_RIGHT,
+    IO_LINE_DETECT_BACK_LEFT, IO_LINE_DETECT_BACK_RIGHT};
+
+static void qre1113_crossing_isr(uint8_t crossed_mask, uint8_t below_mask) {
+  UNUSED(crossed_mask);
+  UNUSED(below_mask);
+  // Only the channels of the sensors have thresholds
+  if (crossing_function != NULL) {
+    crossing_function();
+  }
+}
 
 void qre1113_init(void) {
   ASSERT(!initialized);
@@ -22,3 +37,30 @@ void qre1113_get_voltages(struct qre1113_voltages *voltages) {
   voltages->back_left = values[io_to_adc_idx(IO_LINE_DETECT_BACK_LEFT)];
   voltages->back_right = values[io_to_adc_idx(IO_LINE_DETECT_BACK_RIGHT)];
 }
+
+void qre1113_set_threshold(uint16_t threshold, uint16_t hysteresis,
+                           qre1113_crossing_function function) {
+  ASSERT(initialized);
+  crossing_function = function;
+  for (uint8_t i = 0; i < ARRAY_SIZE(sensor_ios); i++) {
+    adc_set_threshold(io_to_adc_idx(sensor_ios[i]), threshold,
+                      threshold + hysteresis);
+  }
+  adc_set_crossing_callback(qre1113_crossing_isr);
+}
+
+static inline bool qre1113_detected(uint8_t below_mask, io_e io) {
+  return below_mask & (1u << io_to_adc_idx(io));
+}
+
+void qre1113_get_detections(struct qre1113_detections *detections) {
+  const uint8_t below_mask = adc_get_below_mask();
+  detections->front_left =
+      qre1113_detected(below_mask, IO_LINE_DETECT_FRONT_LEFT);
+  detections->front_right =
+      qre1113_detected(below_mask, IO_LINE_DETECT_FRONT_RIGHT);
+  detections->back_left =
+      qre1113_detected(below_mask, IO_LINE_DETECT_BACK_LEFT);
+  detections->back_right =
+      qre1113_detected(below_mask, IO_LINE_DETECT_BACK_RIGHT);
+}
@@ -3,6 +3,7 @@
 
 // Driver for retriving the voltage output from the line sensors QRE1113.
 
+#include <stdbool.h>
 #include <stdint.h>
 
 struct qre1113_voltages {
@@ -12,7 +13,23 @@ struct qre1113_voltages {
   uint16_t back_right;
 };
 
+struct qre1113_detections {
+  bool front_left;
+  bool front_right;
+  bool back_left;
+  bool back_right;
+};
+
+// Called from interrupt context as soon as a sensor crosses the threshold
+typedef void (*qre1113_crossing_function)(void);
+
 void qre1113_init(void);
 void qre1113_get_voltages(struct qre1113_voltages *voltages);
+/* Detection in the ADC interrupt (see adc_set_threshold), a sensor detects
+ * once its voltage drops below threshold, and until it rises above threshold +
+ * hysteresis. function may be NULL. */
+void qre1113_set_threshold(uint16_t threshold, uint16_t hysteresis,
+                           qre1113_crossing_function function);
+void qre1113_get_detections(struct qre1113_detections *detections);
 
 #endif // QRE1113_H
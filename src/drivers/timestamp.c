@@ -0,0 +1,106 @@
+#include "drivers/timestamp.h"
+#include "common/assert_handler.h"
+#include "common/defines.h"
+#include <assert.h>
+#include <msp430.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* SMCLK / 8 (ID_3) / 2 (TAIDEX_1) gives one tick per microsecond. The 16-bit
+ * counter overflows every ~65 ms, the overflows are counted in the interrupt
+ * and make up the upper half of the timestamp. */
+#define TIMESTAMP_INPUT_DIVIDER_EX (2u)
+#define TIMESTAMP_TICKS_PER_US                                                 \
+  (SMCLK / TIMER_INPUT_DIVIDER_3 / TIMESTAMP_INPUT_DIVIDER_EX / CYCLES_1MHZ)
+static_assert(TIMESTAMP_TICKS_PER_US == 1, "Expect one tick per microsecond");
+
+/* An alarm set this close to the current count could be missed (and then fire
+ * after a full wrap instead), so shorter delays are rounded up. */
+#define TIMESTAMP_ALARM_MIN_US (10u)
+
+static volatile uint16_t overflow_count = 0;
+
+// CCR0 has its own vector, so the alarms start at CCR1
+static volatile unsigned int *const alarm_cctl_regs[TIMESTAMP_ALARM_COUNT] = {
+    &TA2CCTL1};
+static volatile unsigned int *const alarm_ccr_regs[TIMESTAMP_ALARM_COUNT] = {
+    &TA2CCR1};
+static timestamp_alarm_function alarm_functions[TIMESTAMP_ALARM_COUNT] = {
+    NULL};
+
+static void timestamp_alarm_isr(timestamp_alarm_e alarm) {
+  // One-shot
+  *alarm_cctl_regs[alarm] &= ~CCIE;
+  const timestamp_alarm_function function = alarm_functions[alarm];
+  alarm_functions[alarm] = NULL;
+  if (function != NULL) {
+    function();
+  }
+}
+
+void timestamp_alarm_start(timestamp_alarm_e alarm, uint16_t delay_us,
+                           timestamp_alarm_function function) {
+  ASSERT(alarm < TIMESTAMP_ALARM_COUNT);
+  ASSERT(function);
+  if (delay_us < TIMESTAMP_ALARM_MIN_US) {
+    delay_us = TIMESTAMP_ALARM_MIN_US;
+  }
+  CRITICAL_SECTION_ENTER();
+  alarm_functions[alarm] = function;
+  *alarm_ccr_regs[alarm] = TA2R + delay_us;
+  *alarm_cctl_regs[alarm] = CCIE; // Also clears CCIFG
+  CRITICAL_SECTION_EXIT();
+}
+
+void timestamp_alarm_stop(timestamp_alarm_e alarm) {
+  ASSERT(alarm < TIMESTAMP_ALARM_COUNT);
+  CRITICAL_SECTION_ENTER();
+  *alarm_cctl_regs[alarm] = 0;
+  alarm_functions[alarm] = NULL;
+  CRITICAL_SECTION_EXIT();
+}
+
+INTERRUPT_FUNCTION(TIMER2_A1_VECTOR) isr_timer_a2(void) {
+  switch (__even_in_range(TA2IV, TA2IV_TAIFG)) {
+  case TA2IV_TACCR1:
+    timestamp_alarm_isr(TIMESTAMP_ALARM_I2C);
+    break;
+  case TA2IV_TAIFG:
+    overflow_count++;
+    break;
+  default:
+    break;
+  }
+}
+
+/* The timer is clocked from SMCLK, which is synchronous with MCLK, so the
+ * counter can be read directly while running. */
+uint32_t timestamp_us(void) {
+  CRITICAL_SECTION_ENTER();
+  uint16_t overflows = overflow_count;
+  const uint16_t ticks = TA2R;
+  /* The overflow interrupt is pending (not yet counted) if the counter
+   * wrapped while interrupts were disabled. */
+  if ((TA2CTL & TAIFG) && ticks < 0x8000u) {
+    overflows++;
+  }
+  CRITICAL_SECTION_EXIT();
+  return ((uint32_t)overflows << 16) | ticks;
+}
+
+static bool initialized = false;
+
+void timestamp_init(void) {
+  ASSERT(!initialized);
+
+  /* TASSEL_2 : Clock source SMCLK
+   * ID_3 : Input divider /8
+   * MC_2 : Continuous mode
+   * TAIE : Interrupt on overflow
+   */
+  TA2CTL = TACLR;
+  TA2EX0 = TAIDEX_1;
+  TA2CTL = TASSEL_2 + ID_3 + MC_2 + TAIE;
+
+  initialized = true;
+}
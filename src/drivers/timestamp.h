@@ -0,0 +1,35 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+/* Free running microsecond timebase (Timer A2) for timestamps, timeouts and
+ * profiling. The 32-bit timestamps wrap after ~71 minutes, so always compare
+ * them by subtraction (see timestamp_elapsed_us). */
+
+#include <stdint.h>
+
+void timestamp_init(void);
+
+// Safe to call from interrupt context
+uint32_t timestamp_us(void);
+
+static inline uint32_t timestamp_elapsed_us(uint32_t since_us) {
+  return timestamp_us() - since_us;
+}
+
+/* One-shot alarms on the compare channels of the same timer, used for
+ * deadlines. Each alarm has a single owner. */
+typedef enum {
+  TIMESTAMP_ALARM_I2C, // TA2CCR1
+  TIMESTAMP_ALARM_COUNT
+} timestamp_alarm_e;
+
+// Called from interrupt context when the alarm expires
+typedef void (*timestamp_alarm_function)(void);
+
+#define TIMESTAMP_ALARM_MAX_US (UINT16_MAX)
+
+void timestamp_alarm_start(timestamp_alarm_e alarm, uint16_t delay_us,
+                           timestamp_alarm_function function);
+void timestamp_alarm_stop(timestamp_alarm_e alarm);
+
+#endif // TIMESTAMP_H
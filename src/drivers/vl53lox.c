@@ -1,8 +1,15 @@
 #include "drivers/vl53lox.h"
 #include "common/assert_handler.h"
 #include "common/defines.h"
+#include "common/trace.h"
+#include "drivers/adc.h"
 #include "drivers/i2c.h"
+#include "drivers/info_flash.h"
 #include "drivers/io.h"
+#include "drivers/timestamp.h"
+#include <assert.h>
+#include <msp430.h>
+#include <stddef.h>
 
 #define REG_IDENTIFICATION_MODEL_ID (0xC0)
 #define REG_VHV_CONFIG_PAD_SCL_SDA_EXTSUP_HV (0x89)
@@ -13,6 +20,7 @@
 #define REG_DYNAMIC_SPAD_NUM_REQUESTED_REF_SPAD (0x4E)
 #define REG_GLOBAL_CONFIG_REF_EN_START_SELECT (0xB6)
 #define REG_SYSTEM_INTERRUPT_CONFIG_GPIO (0x0A)
+#define REG_SYSTEM_THRESH_LOW (0x0E)
 #define REG_GPIO_HV_MUX_ACTIVE_HIGH (0x84)
 #define REG_SYSTEM_INTERRUPT_CLEAR (0x0B)
 #define REG_RESULT_INTERRUPT_STATUS (0x13)
@@ -20,12 +28,33 @@
 #define REG_GLOBAL_CONFIG_SPAD_ENABLES_REF_0 (0xB0)
 #define REG_RESULT_RANGE_STATUS (0x14)
 #define REG_SLAVE_DEVICE_ADDRESS (0x8A)
-
-#define RANGE_SEQUENCE_STEP_TCC (0x10)  // Target CentreCheck
-#define RANGE_SEQUENCE_STEP_MSRC (0x04) // Minimum Signal Rate Check
-#define RANGE_SEQUENCE_STEP_DSS (0x28)  // Dynamic SPAD selection
-#define RANGE_SEQUENCE_STEP_PRE_RANGE (0x40)
-#define RANGE_SEQUENCE_STEP_FINAL_RANGE (0x80)
+#define REG_SYSTEM_INTERMEASUREMENT_PERIOD (0x04)
+#define REG_OSC_CALIBRATE_VAL (0xF8)
+
+#define REG_MSRC_CONFIG_TIMEOUT_MACROP (0x46)
+#define REG_PRE_RANGE_CONFIG_VCSEL_PERIOD (0x50)
+#define REG_PRE_RANGE_CONFIG_TIMEOUT_MACROP_HI (0x51)
+#define REG_PRE_RANGE_CONFIG_VALID_PHASE_LOW (0x56)
+#define REG_PRE_RANGE_CONFIG_VALID_PHASE_HIGH (0x57)
+#define REG_FINAL_RANGE_CONFIG_VALID_PHASE_LOW (0x47)
+#define REG_FINAL_RANGE_CONFIG_VALID_PHASE_HIGH (0x48)
+#define REG_FINAL_RANGE_CONFIG_VCSEL_PERIOD (0x70)
+#define REG_FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI (0x71)
+#define REG_GLOBAL_CONFIG_VCSEL_WIDTH (0x32)
+#define REG_ALGO_PHASECAL_CONFIG_TIMEOUT (0x30)
+#define REG_ALGO_PHASECAL_LIM (0x30) // Page 1 (0xFF = 0x01)
+// Results of the reference calibration (undocumented, from the ST API)
+#define REG_REF_CALIBRATION_VHV (0xCB)
+#define REG_REF_CALIBRATION_PHASE (0xEE)
+
+#define SEQUENCE_STEPS_DEFAULT                                                 \
+  (VL53L0X_SEQUENCE_STEP_DSS + VL53L0X_SEQUENCE_STEP_PRE_RANGE +               \
+   VL53L0X_SEQUENCE_STEP_FINAL_RANGE)
+
+// REG_SYSRANGE_START modes
+#define SYSRANGE_MODE_SINGLESHOT (0x01)
+#define SYSRANGE_MODE_BACK_TO_BACK (0x02)
+#define SYSRANGE_MODE_TIMED (0x04)
 
 #define VL53L0X_EXPECTED_DEVICE_ID (0xEE)
 #define VL53L0X_DEFAULT_ADDRESS (0x29)
@@ -61,33 +90,91 @@ typedef enum {
 typedef enum {
   STATUS_MULTIPLE_NOT_STARTED,
   STATUS_MULTIPLE_MEASURING,
-  STATUS_MULTIPLE_DONE
 } status_multiple_e;
 
 struct vl53l0x_cfg {
   uint8_t addr;
   io_e xshut_io;
+  io_e int_io; // GPIO1, signals new sample ready
 };
 
-struct i2c_8reg {
-  uint8_t addr;
-  uint8_t data;
-};
+/* Polls of the sensor status registers, both calibration and starting a
+ * measurement finish well within this */
+#define VL53L0X_POLL_TIMEOUT_MS (100u)
+// Time to boot after leaving hardware standby is 1.2 ms max (datasheet)
+#define VL53L0X_BOOT_TIMEOUT_US (2000u)
+
+typedef enum {
+  BOOT_STAGE_ADDRESSES,
+  BOOT_STAGE_CONFIG,
+  BOOT_STAGE_CALIBRATION,
+  BOOT_STAGE_COUNT
+} boot_stage_e;
 
 static const struct vl53l0x_cfg vl53l0x_cfgs[] = {
-    [VL53L0X_IDX_FRONT] = {.addr = 0x30, .xshut_io = IO_XSHUT_FRONT},
+    [VL53L0X_IDX_FRONT] = {.addr = 0x30,
+                           .xshut_io = IO_XSHUT_FRONT,
+                           .int_io = IO_RANGE_SENSOR_FRONT_INT},
 #if defined(NSUMO)
-    [VL53L0X_IDX_LEFT] = {.addr = 0x31, .xshut_io = IO_XSHUT_LEFT},
-    [VL53L0X_IDX_RIGHT] = {.addr = 0x32, .xshut_io = IO_XSHUT_RIGHT},
+    [VL53L0X_IDX_LEFT] = {.addr = 0x31,
+                          .xshut_io = IO_XSHUT_LEFT,
+                          .int_io = IO_RANGE_SENSOR_LEFT_INT},
+    [VL53L0X_IDX_RIGHT] = {.addr = 0x32,
+                           .xshut_io = IO_XSHUT_RIGHT,
+                           .int_io = IO_RANGE_SENSOR_RIGHT_INT},
     [VL53L0X_IDX_FRONT_RIGHT] = {.addr = 0x33,
-                                 .xshut_io = IO_XSHUT_FRONT_RIGHT},
-    [VL53L0X_IDX_FRONT_LEFT] = {.addr = 0x34, .xshut_io = IO_XSHUT_FRONT_LEFT},
+                                 .xshut_io = IO_XSHUT_FRONT_RIGHT,
+                                 .int_io = IO_RANGE_SENSOR_FRONT_RIGHT_INT},
+    [VL53L0X_IDX_FRONT_LEFT] = {.addr = 0x34,
+                                .xshut_io = IO_XSHUT_FRONT_LEFT,
+                                .int_io = IO_RANGE_SENSOR_FRONT_LEFT_INT},
 #endif
 };
 
-static uint8_t stop_variable = 0;
-// Reads/Writes to this can be considered atomic on MSP430
+/* Per sensor data that is slow to retrieve (NVM reads and calibration polls).
+ * It's stored in info flash the first time, and loaded on later boots. */
+struct vl53l0x_calibration {
+  uint8_t spad_map[SPAD_MAP_ROW_COUNT];
+  uint8_t stop_variable;
+  uint8_t vhv_settings;
+  uint8_t phase_cal;
+  int8_t temperature_c; // Of the reference calibration
+  bool valid;
+  uint32_t part_uid[2]; // Of the sensor it was done on
+};
+#define TEMPERATURE_UNKNOWN (INT8_MIN)
+static struct vl53l0x_calibration calibrations[VL53L0X_IDX_COUNT];
+// Changed by vl53l0x_set_profile and the reference calibration
+static uint8_t sensor_sequence_steps[VL53L0X_IDX_COUNT] = {
+    SEQUENCE_STEPS_DEFAULT, SEQUENCE_STEPS_DEFAULT, SEQUENCE_STEPS_DEFAULT,
+    SEQUENCE_STEPS_DEFAULT, SEQUENCE_STEPS_DEFAULT};
+// Sensors that answered at boot, and the subset measured by *_multiple
+static uint8_t present_mask = 0;
+static uint8_t active_mask = 0;
+// Sensors calibrated at boot (the others were cached)
+static uint8_t boot_calibrated_mask = 0;
+static uint32_t boot_stage_us[BOOT_STAGE_COUNT] = {0};
+static_assert(sizeof(calibrations) <= INFO_FLASH_DATA_MAX_SIZE,
+              "Calibration doesn't fit in info flash segment");
+
+// 0 if the sensors signal every sample, see vl53l0x_set_threshold_mode
+static uint16_t threshold_mm = 0;
+
+// Reads/Writes to these can be considered atomic on MSP430
 static volatile status_multiple_e status_multiple = STATUS_MULTIPLE_NOT_STARTED;
+// Set by the GPIO1 interrupt of each sensor
+static volatile bool sample_ready[VL53L0X_IDX_COUNT] = {false};
+// Captured by the same interrupt, the time the sample was done
+static volatile uint32_t sample_ready_us[VL53L0X_IDX_COUNT] = {0};
+static uint16_t sample_seqs[VL53L0X_IDX_COUNT] = {0};
+/* Health of the sensors read by the *_multiple functions, see
+ * vl53l0x_update_reset */
+#define FAILURES_BEFORE_RESET (3u)
+static struct vl53l0x_health health[VL53L0X_IDX_COUNT] = {0};
+static uint8_t resetting_mask = 0; // Off the schedule
+// When the sensor was started or last signaled, for the sample timeout
+static uint32_t waiting_since_us[VL53L0X_IDX_COUNT] = {0};
+static bool continuous = false;
 static bool initialized = false;
 
 /* We can read the model id to confirm that the device is booted.
@@ -101,75 +188,88 @@ static vl53l0x_result_e device_is_booted(void) {
                                                    : VL53L0X_RESULT_ERROR_BOOT;
 }
 
-static vl53l0x_result_e vl53l0x_write_8regs(const struct i2c_8reg *regs,
-                                            uint8_t cnt) {
-  for (uint8_t i = 0; i < cnt; i++) {
-    if (i2c_write_addr8_data8(regs[i].addr, regs[i].data)) {
-      return VL53L0X_RESULT_ERROR_I2C;
-    }
-  }
-  return VL53L0X_RESULT_OK;
+static vl53l0x_result_e
+vl53l0x_run_script(const struct i2c_script_op *ops, uint8_t count,
+                   uint8_t *vars) {
+  return i2c_script_run(ops, count, vars) ? VL53L0X_RESULT_ERROR_I2C
+                                          : VL53L0X_RESULT_OK;
 }
 
 // One time device initialization
 static vl53l0x_result_e vl53l0x_data_init(void) {
-  // Set 2v8 mode
-  uint8_t vhv_config_scl_sda = 0;
-  if (i2c_read_addr8_data8(REG_VHV_CONFIG_PAD_SCL_SDA_EXTSUP_HV,
-                           &vhv_config_scl_sda)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
-  vhv_config_scl_sda |= 0x01;
-  if (i2c_write_addr8_data8(REG_VHV_CONFIG_PAD_SCL_SDA_EXTSUP_HV,
-                            vhv_config_scl_sda)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
+  /* Set 2v8 mode, I2C standard mode and various registers (same as ST
+   * reference code) */
+  static const struct i2c_script_op data_init_script[] = {
+      I2C_RMW(REG_VHV_CONFIG_PAD_SCL_SDA_EXTSUP_HV, 0x01, 0x01),
+      I2C_WRITE(0x88, 0x00)};
+  return vl53l0x_run_script(data_init_script, ARRAY_SIZE(data_init_script),
+                            NULL);
+}
 
-  // Set I2C standard mode
-  if (i2c_write_addr8_data8(0x88, 0x00)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
+// Written before each measurement start, differs between sensors
+static vl53l0x_result_e vl53l0x_get_stop_variable(uint8_t *stop_variable) {
+  static const struct i2c_script_op stop_variable_script[] = {
+      I2C_WRITE(0x80, 0x01), I2C_WRITE(0xFF, 0x01), I2C_WRITE(0x00, 0x00),
+      I2C_READ_VAR(0x91, 0), I2C_WRITE(0x00, 0x01), I2C_WRITE(0xFF, 0x00),
+      I2C_WRITE(0x80, 0x00)};
+  return vl53l0x_run_script(stop_variable_script,
+                            ARRAY_SIZE(stop_variable_script), stop_variable);
+}
 
-  // Set various registers (same as ST reference code)
-  const struct i2c_8reg data_regs1[] = {
-      {0x80, 0x01}, {0xFF, 0x01}, {0x00, 0x00}};
-  vl53l0x_result_e result =
-      vl53l0x_write_8regs(data_regs1, ARRAY_SIZE(data_regs1));
+/* The NVM is read through a window that must be opened before (and closed
+ * after) reading. Each read requests an option and waits for the strobe
+ * register to signal that its value is in 0x90 (same as the ST API). */
+static vl53l0x_result_e vl53l0x_nvm_open(void) {
+  static const struct i2c_script_op nvm_open_script[] = {
+      I2C_WRITE(0x80, 0x01), I2C_WRITE(0xFF, 0x01), I2C_WRITE(0x00, 0x00),
+      I2C_WRITE(0xFF, 0x06), I2C_RMW(0x83, 0x04, 0x04),
+      I2C_WRITE(0xFF, 0x07), I2C_WRITE(0x81, 0x01), I2C_WRITE(0x80, 0x01)};
+  return vl53l0x_run_script(nvm_open_script, ARRAY_SIZE(nvm_open_script),
+                            NULL);
+}
+
+static vl53l0x_result_e vl53l0x_nvm_close(void) {
+  static const struct i2c_script_op nvm_close_script[] = {
+      I2C_WRITE(0x81, 0x00), I2C_WRITE(0xFF, 0x06), I2C_RMW(0x83, 0x04, 0x00),
+      I2C_WRITE(0xFF, 0x01), I2C_WRITE(0x00, 0x01), I2C_WRITE(0xFF, 0x00),
+      I2C_WRITE(0x80, 0x00)};
+  return vl53l0x_run_script(nvm_close_script, ARRAY_SIZE(nvm_close_script),
+                            NULL);
+}
+
+static vl53l0x_result_e vl53l0x_nvm_read(uint8_t option, uint32_t *data) {
+  static const struct i2c_script_op nvm_read_script[] = {
+      I2C_WRITE_VAR(0x94, 0), I2C_WRITE(0x83, 0x00),
+      I2C_POLL_SET(0x83, 0xFF, VL53L0X_POLL_TIMEOUT_MS),
+      I2C_WRITE(0x83, 0x01)};
+  const vl53l0x_result_e result = vl53l0x_run_script(
+      nvm_read_script, ARRAY_SIZE(nvm_read_script), &option);
   if (result) {
     return result;
   }
-
-  // TODO: It may be unnecessary to retrieve the stop variable for each sensor
-  if (i2c_read_addr8_data8(0x91, &stop_variable)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
-
-  // Set various registers (same as ST reference code)
-  const struct i2c_8reg data_regs2[] = {
-      {0x00, 0x01}, {0xFF, 0x00}, {0x80, 0x00}};
-  result = vl53l0x_write_8regs(data_regs2, ARRAY_SIZE(data_regs2));
-
-  return result;
+  return i2c_read_addr8_data32(0x90, data) ? VL53L0X_RESULT_ERROR_I2C
+                                            : VL53L0X_RESULT_OK;
 }
 
-/* Wait for strobe value to be set. This is used when we read values
- * from NVM (non volatile memory). */
-static vl53l0x_result_e vl53l0x_read_strobe(void) {
-  uint8_t strobe = 0;
-  if (i2c_write_addr8_data8(0x83, 0x00)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
-  i2c_result_e result = I2C_RESULT_OK;
-  do {
-    result = i2c_read_addr8_data8(0x83, &strobe);
-  } while (result == I2C_RESULT_OK && (strobe == 0));
+/* Unique ID of the part, written by ST at production. It identifies the
+ * sensor a cached calibration belongs to, so a replaced (or swapped) sensor
+ * is calibrated again. Only read on its own to check a cached calibration,
+ * else with the SPAD info (see vl53l0x_get_spad_info_from_nvm). */
+#define NVM_OPTION_SPAD_INFO (0x6B)
+#define NVM_OPTION_PART_UID_UPPER (0x7B)
+#define NVM_OPTION_PART_UID_LOWER (0x7C)
+static vl53l0x_result_e vl53l0x_get_part_uid(uint32_t part_uid[2]) {
+  vl53l0x_result_e result = vl53l0x_nvm_open();
   if (result) {
-    return VL53L0X_RESULT_ERROR_I2C;
+    return result;
   }
-  if (i2c_write_addr8_data8(0x83, 0x01)) {
-    return VL53L0X_RESULT_ERROR_I2C;
+  result = vl53l0x_nvm_read(NVM_OPTION_PART_UID_UPPER, &part_uid[0]);
+  if (!result) {
+    result = vl53l0x_nvm_read(NVM_OPTION_PART_UID_LOWER, &part_uid[1]);
   }
-  return VL53L0X_RESULT_OK;
+  // Closed even if the read failed
+  const vl53l0x_result_e close_result = vl53l0x_nvm_close();
+  return result ? result : close_result;
 }
 
 /**
@@ -184,47 +284,29 @@ static vl53l0x_result_e vl53l0x_read_strobe(void) {
  * or only non-aperture SPADs. The number of SPADs to enable and which type
  * are also saved during the calibration step at ST factory and can be retrieved
  * from NVM.
+ * The part UID is read while the NVM is open, it's zero if that fails (the
+ * calibration then misses the cache on the next boot).
  */
 static vl53l0x_result_e
 vl53l0x_get_spad_info_from_nvm(uint8_t *spad_count, uint8_t *spad_type,
-                               uint8_t good_spad_map[6]) {
-  uint8_t tmp_data8 = 0;
+                               uint8_t good_spad_map[6], uint32_t part_uid[2]) {
   uint32_t tmp_data32 = 0;
 
-  const struct i2c_8reg nvm_setup_regs[] = {
-      {0x80, 0x01}, {0xFF, 0x01}, {0x00, 0x00}, {0xFF, 0x06},
-      {0xFF, 0x07}, {0x81, 0x01}, {0x80, 0x01}};
-
-  // Setup to read from NVM
-  vl53l0x_result_e result = vl53l0x_write_8regs(nvm_setup_regs, 4);
-  if (result) {
-    return result;
-  }
-  if (i2c_read_addr8_data8(0x83, &tmp_data8)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
-  if (i2c_write_addr8_data8(0x83, tmp_data8 | 0x04)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
-  result =
-      vl53l0x_write_8regs(nvm_setup_regs + 4, ARRAY_SIZE(nvm_setup_regs) - 4);
+  vl53l0x_result_e result = vl53l0x_nvm_open();
   if (result) {
     return result;
   }
-
-  // Get the SPAD count and type
-  if (i2c_write_addr8_data8(0x94, 0x6b)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
-  result = vl53l0x_read_strobe();
+  result = vl53l0x_nvm_read(NVM_OPTION_SPAD_INFO, &tmp_data32);
   if (result) {
     return result;
   }
-  if (i2c_read_addr8_data32(0x90, &tmp_data32)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
   *spad_count = (tmp_data32 >> 8) & 0x7f;
   *spad_type = (tmp_data32 >> 15) & 0x01;
+  if (vl53l0x_nvm_read(NVM_OPTION_PART_UID_UPPER, &part_uid[0]) ||
+      vl53l0x_nvm_read(NVM_OPTION_PART_UID_LOWER, &part_uid[1])) {
+    part_uid[0] = 0;
+    part_uid[1] = 0;
+  }
 
   /* Since the good SPAD map is already stored in
    * REG_GLOBAL_CONFIG_SPAD_ENABLES_REF_0 we can simply read that register
@@ -259,23 +341,8 @@ vl53l0x_get_spad_info_from_nvm(uint8_t *spad_count, uint8_t *spad_type,
     good_spad_map[5] = (uint8_t)((tmp_data32 >> 16) & 0xFF);
 
 #endif
-  const struct i2c_8reg nvm_restore_regs[] = {{0x81, 0x00}, {0xFF, 0x06},
-                                              {0xFF, 0x01}, {0x00, 0x01},
-                                              {0xFF, 0x00}, {0x80, 0x00}};
-
   // Restore after reading from NVM
-  result = vl53l0x_write_8regs(nvm_restore_regs, 2);
-  if (result) {
-    return result;
-  }
-  if (i2c_read_addr8_data8(0x83, &tmp_data8)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
-  if (i2c_write_addr8_data8(0x83, tmp_data8 & 0xfb)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
-  result = vl53l0x_write_8regs(nvm_restore_regs + 2,
-                               ARRAY_SIZE(nvm_restore_regs) - 2);
+  result = vl53l0x_nvm_close();
   if (result) {
     return result;
   }
@@ -289,35 +356,28 @@ vl53l0x_get_spad_info_from_nvm(uint8_t *spad_count, uint8_t *spad_type,
 }
 
 /**
- * Sets the SPADs according to the value saved to NVM by ST during production.
- * Assuming similar conditions (e.g. no cover glass), this should give
- * reasonable readings and we can avoid running ref spad management (tedious
- * code).
+ * Gets the SPAD map to enable according to the value saved to NVM by ST during
+ * production. Assuming similar conditions (e.g. no cover glass), this should
+ * give reasonable readings and we can avoid running ref spad management
+ * (tedious code).
  */
-static vl53l0x_result_e vl53l0x_set_spads_from_nvm(void) {
-  uint8_t spad_map[SPAD_MAP_ROW_COUNT] = {0};
+static vl53l0x_result_e
+vl53l0x_get_spad_map_from_nvm(uint8_t spad_map[SPAD_MAP_ROW_COUNT],
+                              uint32_t part_uid[2]) {
   uint8_t good_spad_map[SPAD_MAP_ROW_COUNT] = {0};
   uint8_t spads_enabled_count = 0;
   uint8_t spads_to_enable_count = 0;
   uint8_t spad_type = 0;
 
   vl53l0x_result_e result = vl53l0x_get_spad_info_from_nvm(
-      &spads_to_enable_count, &spad_type, good_spad_map);
+      &spads_to_enable_count, &spad_type, good_spad_map, part_uid);
   if (result) {
     return result;
   }
 
-  const struct i2c_8reg spad_regs[] = {
-      {0xFF, 0x01},
-      {REG_DYNAMIC_SPAD_REF_EN_START_OFFSET, 0x00},
-      {REG_DYNAMIC_SPAD_NUM_REQUESTED_REF_SPAD, 0x2C},
-      {0xFF, 0x00},
-      {REG_GLOBAL_CONFIG_REF_EN_START_SELECT, SPAD_START_SELECT}};
-  result = vl53l0x_write_8regs(spad_regs, ARRAY_SIZE(spad_regs));
-  if (result) {
-    return result;
+  for (int row = 0; row < SPAD_MAP_ROW_COUNT; row++) {
+    spad_map[row] = 0;
   }
-
   uint8_t offset =
       (spad_type == SPAD_TYPE_APERTURE) ? SPAD_APERTURE_START_INDEX : 0;
 
@@ -352,6 +412,22 @@ static vl53l0x_result_e vl53l0x_set_spads_from_nvm(void) {
   if (spads_enabled_count != spads_to_enable_count) {
     return VL53L0X_RESULT_ERROR_SPAD;
   }
+  return VL53L0X_RESULT_OK;
+}
+
+static vl53l0x_result_e
+vl53l0x_set_spads(const uint8_t spad_map[SPAD_MAP_ROW_COUNT]) {
+  static const struct i2c_script_op spad_script[] = {
+      I2C_WRITE(0xFF, 0x01),
+      I2C_WRITE(REG_DYNAMIC_SPAD_REF_EN_START_OFFSET, 0x00),
+      I2C_WRITE(REG_DYNAMIC_SPAD_NUM_REQUESTED_REF_SPAD, 0x2C),
+      I2C_WRITE(0xFF, 0x00),
+      I2C_WRITE(REG_GLOBAL_CONFIG_REF_EN_START_SELECT, SPAD_START_SELECT)};
+  vl53l0x_result_e result =
+      vl53l0x_run_script(spad_script, ARRAY_SIZE(spad_script), NULL);
+  if (result) {
+    return result;
+  }
 
   // Write the new SPAD configuration
   const uint8_t reg_global_cfg_addr = REG_GLOBAL_CONFIG_SPAD_ENABLES_REF_0;
@@ -365,69 +441,104 @@ static vl53l0x_result_e vl53l0x_set_spads_from_nvm(void) {
 // Load tuning settings (same as default tuning settings provided by ST api
 // code)
 static vl53l0x_result_e vl53l0x_load_default_tuning_settings(void) {
-  const struct i2c_8reg default_tuning_regs[] = {
-      {0xFF, 0x01}, {0x00, 0x00}, {0xFF, 0x00}, {0x09, 0x00}, {0x10, 0x00},
-      {0x11, 0x00}, {0x24, 0x01}, {0x25, 0xFF}, {0x75, 0x00}, {0xFF, 0x01},
-      {0x4E, 0x2C}, {0x48, 0x00}, {0x30, 0x20}, {0xFF, 0x00}, {0x30, 0x09},
-      {0x54, 0x00}, {0x31, 0x04}, {0x32, 0x03}, {0x40, 0x83}, {0x46, 0x25},
-      {0x60, 0x00}, {0x27, 0x00}, {0x50, 0x06}, {0x51, 0x00}, {0x52, 0x96},
-      {0x56, 0x08}, {0x57, 0x30}, {0x61, 0x00}, {0x62, 0x00}, {0x64, 0x00},
-      {0x65, 0x00}, {0x66, 0xA0}, {0xFF, 0x01}, {0x22, 0x32}, {0x47, 0x14},
-      {0x49, 0xFF}, {0x4A, 0x00}, {0xFF, 0x00}, {0x7A, 0x0A}, {0x7B, 0x00},
-      {0x78, 0x21}, {0xFF, 0x01}, {0x23, 0x34}, {0x42, 0x00}, {0x44, 0xFF},
-      {0x45, 0x26}, {0x46, 0x05}, {0x40, 0x40}, {0x0E, 0x06}, {0x20, 0x1A},
-      {0x43, 0x40}, {0xFF, 0x00}, {0x34, 0x03}, {0x35, 0x44}, {0xFF, 0x01},
-      {0x31, 0x04}, {0x4B, 0x09}, {0x4C, 0x05}, {0x4D, 0x04}, {0xFF, 0x00},
-      {0x44, 0x00}, {0x45, 0x20}, {0x47, 0x08}, {0x48, 0x28}, {0x67, 0x00},
-      {0x70, 0x04}, {0x71, 0x01}, {0x72, 0xFE}, {0x76, 0x00}, {0x77, 0x00},
-      {0xFF, 0x01}, {0x0D, 0x01}, {0xFF, 0x00}, {0x80, 0x01}, {0x01, 0xF8},
-      {0xFF, 0x01}, {0x8E, 0x01}, {0x00, 0x01}, {0xFF, 0x00}, {0x80, 0x00}};
-  return vl53l0x_write_8regs(default_tuning_regs,
-                             ARRAY_SIZE(default_tuning_regs));
+  static const struct i2c_script_op default_tuning_script[] = {
+      I2C_WRITE(0xFF, 0x01), I2C_WRITE(0x00, 0x00), I2C_WRITE(0xFF, 0x00),
+      I2C_WRITE(0x09, 0x00), I2C_WRITE(0x10, 0x00), I2C_WRITE(0x11, 0x00),
+      I2C_WRITE(0x24, 0x01), I2C_WRITE(0x25, 0xFF), I2C_WRITE(0x75, 0x00),
+      I2C_WRITE(0xFF, 0x01), I2C_WRITE(0x4E, 0x2C), I2C_WRITE(0x48, 0x00),
+      I2C_WRITE(0x30, 0x20), I2C_WRITE(0xFF, 0x00), I2C_WRITE(0x30, 0x09),
+      I2C_WRITE(0x54, 0x00), I2C_WRITE(0x31, 0x04), I2C_WRITE(0x32, 0x03),
+      I2C_WRITE(0x40, 0x83), I2C_WRITE(0x46, 0x25), I2C_WRITE(0x60, 0x00),
+      I2C_WRITE(0x27, 0x00), I2C_WRITE(0x50, 0x06), I2C_WRITE(0x51, 0x00),
+      I2C_WRITE(0x52, 0x96), I2C_WRITE(0x56, 0x08), I2C_WRITE(0x57, 0x30),
+      I2C_WRITE(0x61, 0x00), I2C_WRITE(0x62, 0x00), I2C_WRITE(0x64, 0x00),
+      I2C_WRITE(0x65, 0x00), I2C_WRITE(0x66, 0xA0), I2C_WRITE(0xFF, 0x01),
+      I2C_WRITE(0x22, 0x32), I2C_WRITE(0x47, 0x14), I2C_WRITE(0x49, 0xFF),
+      I2C_WRITE(0x4A, 0x00), I2C_WRITE(0xFF, 0x00), I2C_WRITE(0x7A, 0x0A),
+      I2C_WRITE(0x7B, 0x00), I2C_WRITE(0x78, 0x21), I2C_WRITE(0xFF, 0x01),
+      I2C_WRITE(0x23, 0x34), I2C_WRITE(0x42, 0x00), I2C_WRITE(0x44, 0xFF),
+      I2C_WRITE(0x45, 0x26), I2C_WRITE(0x46, 0x05), I2C_WRITE(0x40, 0x40),
+      I2C_WRITE(0x0E, 0x06), I2C_WRITE(0x20, 0x1A), I2C_WRITE(0x43, 0x40),
+      I2C_WRITE(0xFF, 0x00), I2C_WRITE(0x34, 0x03), I2C_WRITE(0x35, 0x44),
+      I2C_WRITE(0xFF, 0x01), I2C_WRITE(0x31, 0x04), I2C_WRITE(0x4B, 0x09),
+      I2C_WRITE(0x4C, 0x05), I2C_WRITE(0x4D, 0x04), I2C_WRITE(0xFF, 0x00),
+      I2C_WRITE(0x44, 0x00), I2C_WRITE(0x45, 0x20), I2C_WRITE(0x47, 0x08),
+      I2C_WRITE(0x48, 0x28), I2C_WRITE(0x67, 0x00), I2C_WRITE(0x70, 0x04),
+      I2C_WRITE(0x71, 0x01), I2C_WRITE(0x72, 0xFE), I2C_WRITE(0x76, 0x00),
+      I2C_WRITE(0x77, 0x00), I2C_WRITE(0xFF, 0x01), I2C_WRITE(0x0D, 0x01),
+      I2C_WRITE(0xFF, 0x00), I2C_WRITE(0x80, 0x01), I2C_WRITE(0x01, 0xF8),
+      I2C_WRITE(0xFF, 0x01), I2C_WRITE(0x8E, 0x01), I2C_WRITE(0x00, 0x01),
+      I2C_WRITE(0xFF, 0x00), I2C_WRITE(0x80, 0x00)};
+  return vl53l0x_run_script(default_tuning_script,
+                            ARRAY_SIZE(default_tuning_script), NULL);
 }
 
-static vl53l0x_result_e vl53l0x_configure_interrupt(void) {
-  // Interrupt on new sample ready
-  if (i2c_write_addr8_data8(REG_SYSTEM_INTERRUPT_CONFIG_GPIO, 0x04)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
+// Values of REG_SYSTEM_INTERRUPT_CONFIG_GPIO
+#define INTERRUPT_GPIO_LEVEL_LOW (0x01) // Range below REG_SYSTEM_THRESH_LOW
+#define INTERRUPT_GPIO_NEW_SAMPLE_READY (0x04)
 
-  /* Configure active low since the pin is pulled-up on most breakout boards */
-  uint8_t gpio_hv_mux_active_high = 0;
-  if (i2c_read_addr8_data8(REG_GPIO_HV_MUX_ACTIVE_HIGH,
-                           &gpio_hv_mux_active_high)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
-  gpio_hv_mux_active_high &= ~0x10;
-  if (i2c_write_addr8_data8(REG_GPIO_HV_MUX_ACTIVE_HIGH,
-                            gpio_hv_mux_active_high)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
+static vl53l0x_result_e vl53l0x_configure_interrupt(void) {
+  /* Interrupt on new sample ready, active low since the pin is pulled-up on
+   * most breakout boards */
+  static const struct i2c_script_op interrupt_script[] = {
+      I2C_WRITE(REG_SYSTEM_INTERRUPT_CONFIG_GPIO,
+                INTERRUPT_GPIO_NEW_SAMPLE_READY),
+      I2C_RMW(REG_GPIO_HV_MUX_ACTIVE_HIGH, 0x10, 0x00),
+      I2C_WRITE(REG_SYSTEM_INTERRUPT_CLEAR, 0x01)};
+  return vl53l0x_run_script(interrupt_script, ARRAY_SIZE(interrupt_script),
+                            NULL);
+}
 
-  if (i2c_write_addr8_data8(REG_SYSTEM_INTERRUPT_CLEAR, 0x01)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
-  return VL53L0X_RESULT_OK;
+static inline void vl53l0x_sample_ready_isr(vl53l0x_idx_e idx) {
+  sample_ready_us[idx] = timestamp_us();
+  sample_ready[idx] = true;
 }
 
-static void front_measurement_done_isr() {
-  status_multiple = STATUS_MULTIPLE_DONE;
+/* The interrupt functions take no argument, so there is one per sensor to know
+ * which one is done */
+static void front_sample_ready_isr(void) {
+  vl53l0x_sample_ready_isr(VL53L0X_IDX_FRONT);
+}
+#if defined(NSUMO)
+static void left_sample_ready_isr(void) {
+  vl53l0x_sample_ready_isr(VL53L0X_IDX_LEFT);
+}
+static void right_sample_ready_isr(void) {
+  vl53l0x_sample_ready_isr(VL53L0X_IDX_RIGHT);
 }
+static void front_left_sample_ready_isr(void) {
+  vl53l0x_sample_ready_isr(VL53L0X_IDX_FRONT_LEFT);
+}
+static void front_right_sample_ready_isr(void) {
+  vl53l0x_sample_ready_isr(VL53L0X_IDX_FRONT_RIGHT);
+}
+#endif
+
+static const isr_function sample_ready_isrs[] = {
+    [VL53L0X_IDX_FRONT] = front_sample_ready_isr,
+#if defined(NSUMO)
+    [VL53L0X_IDX_LEFT] = left_sample_ready_isr,
+    [VL53L0X_IDX_RIGHT] = right_sample_ready_isr,
+    [VL53L0X_IDX_FRONT_LEFT] = front_left_sample_ready_isr,
+    [VL53L0X_IDX_FRONT_RIGHT] = front_right_sample_ready_isr,
+#endif
+};
 
-static void vl53l0x_configure_front_sensor_interrupt(void) {
-  static const struct io_config front_interrupt_config = {
+static void vl53l0x_configure_sensor_interrupt(vl53l0x_idx_e idx) {
+  static const struct io_config interrupt_config = {
       .select = IO_SELECT_GPIO,
       .pupd_resistor = IO_PUPD_DISABLED,
       .dir = IO_DIR_INPUT,
       .out = IO_OUT_LOW,
   };
+  const io_e int_io = vl53l0x_cfgs[idx].int_io;
   struct io_config current_config;
-  io_get_current_config(IO_RANGE_SENSOR_FRONT_INT, &current_config);
-  ASSERT(io_config_compare(&front_interrupt_config, &current_config));
+  io_get_current_config(int_io, &current_config);
+  ASSERT(io_config_compare(&interrupt_config, &current_config));
 
-  io_configure_interrupt(IO_RANGE_SENSOR_FRONT_INT, IO_TRIGGER_FALLING,
-                         front_measurement_done_isr);
-  io_enable_interrupt(IO_RANGE_SENSOR_FRONT_INT);
+  // Active low (see vl53l0x_configure_interrupt)
+  io_configure_interrupt(int_io, IO_TRIGGER_FALLING, sample_ready_isrs[idx]);
+  io_enable_interrupt(int_io);
 }
 
 // Enable (or disable) specific steps in the sequence
@@ -440,8 +551,9 @@ vl53l0x_set_sequence_steps_enabled(uint8_t sequence_step) {
 }
 
 // Basic device initialization
-static vl53l0x_result_e vl53l0x_static_init(void) {
-  vl53l0x_result_e result = vl53l0x_set_spads_from_nvm();
+static vl53l0x_result_e
+vl53l0x_static_init(const uint8_t spad_map[SPAD_MAP_ROW_COUNT]) {
+  vl53l0x_result_e result = vl53l0x_set_spads(spad_map);
   if (result) {
     return result;
   }
@@ -456,14 +568,15 @@ static vl53l0x_result_e vl53l0x_static_init(void) {
     return result;
   }
 
-  result = vl53l0x_set_sequence_steps_enabled(RANGE_SEQUENCE_STEP_DSS +
-                                              RANGE_SEQUENCE_STEP_PRE_RANGE +
-                                              RANGE_SEQUENCE_STEP_FINAL_RANGE);
+  result = vl53l0x_set_sequence_steps_enabled(SEQUENCE_STEPS_DEFAULT);
   return result;
 }
 
+/* Temperature calibration needs to be run again if the temperature changes by
+ * more than 8 degrees according to the datasheet. The calibration runs on the
+ * sensor, so the MCU is free to talk to other sensors until it's finished. */
 static vl53l0x_result_e
-vl53l0x_perform_single_ref_calibration(vl53l0x_calibration_type_e calib_type) {
+vl53l0x_start_ref_calibration(vl53l0x_calibration_type_e calib_type) {
   uint8_t sysrange_start = 0;
   uint8_t sequence_config = 0;
   switch (calib_type) {
@@ -476,50 +589,293 @@ vl53l0x_perform_single_ref_calibration(vl53l0x_calibration_type_e calib_type) {
     sysrange_start = 0x01 | 0x00;
     break;
   }
-  if (i2c_write_addr8_data8(REG_SYSTEM_SEQUENCE_CONFIG, sequence_config)) {
-    return VL53L0X_RESULT_ERROR_I2C;
+  static const struct i2c_script_op start_script[] = {
+      I2C_WRITE_VAR(REG_SYSTEM_SEQUENCE_CONFIG, 0),
+      I2C_WRITE_VAR(REG_SYSRANGE_START, 1)};
+  uint8_t vars[] = {sequence_config, sysrange_start};
+  return vl53l0x_run_script(start_script, ARRAY_SIZE(start_script), vars);
+}
+
+// Waits for the interrupt of the calibration started on the sensor
+static vl53l0x_result_e vl53l0x_finish_ref_calibration(void) {
+  static const struct i2c_script_op finish_script[] = {
+      I2C_POLL_SET(REG_RESULT_INTERRUPT_STATUS, 0x07, VL53L0X_POLL_TIMEOUT_MS),
+      I2C_WRITE(REG_SYSTEM_INTERRUPT_CLEAR, 0x01),
+      I2C_WRITE(REG_SYSRANGE_START, 0x00)};
+  return vl53l0x_run_script(finish_script, ARRAY_SIZE(finish_script), NULL);
+}
+
+static vl53l0x_result_e
+vl53l0x_perform_single_ref_calibration(vl53l0x_calibration_type_e calib_type) {
+  const vl53l0x_result_e result = vl53l0x_start_ref_calibration(calib_type);
+  if (result) {
+    return result;
   }
-  if (i2c_write_addr8_data8(REG_SYSRANGE_START, sysrange_start)) {
-    return VL53L0X_RESULT_ERROR_I2C;
+  return vl53l0x_finish_ref_calibration();
+}
+
+static const struct i2c_script_op ref_calibration_enter_script[] = {
+    I2C_WRITE(0xFF, 0x01), I2C_WRITE(0x00, 0x00), I2C_WRITE(0xFF, 0x00)};
+static const struct i2c_script_op ref_calibration_exit_script[] = {
+    I2C_WRITE(0xFF, 0x01), I2C_WRITE(0x00, 0x01), I2C_WRITE(0xFF, 0x00)};
+
+// Reads the result of the VHV and phase calibration (same as ST API)
+static vl53l0x_result_e
+vl53l0x_get_ref_calibration(struct vl53l0x_calibration *calibration) {
+  static const struct i2c_script_op read_script[] = {
+      I2C_READ_VAR(REG_REF_CALIBRATION_VHV, 0),
+      I2C_READ_VAR(REG_REF_CALIBRATION_PHASE, 1)};
+  uint8_t vars[2] = {0};
+  vl53l0x_result_e result =
+      vl53l0x_run_script(ref_calibration_enter_script,
+                         ARRAY_SIZE(ref_calibration_enter_script), NULL);
+  if (!result) {
+    result = vl53l0x_run_script(read_script, ARRAY_SIZE(read_script), vars);
   }
-  // Wait for interrupt
-  uint8_t interrupt_status = 0;
-  i2c_result_e i2c_result = I2C_RESULT_OK;
-  do {
-    i2c_result =
-        i2c_read_addr8_data8(REG_RESULT_INTERRUPT_STATUS, &interrupt_status);
-  } while (i2c_result == I2C_RESULT_OK && ((interrupt_status & 0x07) == 0));
-  if (i2c_result) {
-    return VL53L0X_RESULT_ERROR_I2C;
+  if (!result) {
+    result = vl53l0x_run_script(ref_calibration_exit_script,
+                                ARRAY_SIZE(ref_calibration_exit_script), NULL);
   }
-  if (i2c_write_addr8_data8(REG_SYSTEM_INTERRUPT_CLEAR, 0x01)) {
-    return VL53L0X_RESULT_ERROR_I2C;
+  calibration->vhv_settings = vars[0];
+  calibration->phase_cal = vars[1] & 0xEF;
+  return result;
+}
+
+// Restores a previous reference calibration instead of performing it
+static vl53l0x_result_e
+vl53l0x_set_ref_calibration(const struct vl53l0x_calibration *calibration) {
+  static const struct i2c_script_op write_script[] = {
+      I2C_WRITE_VAR(REG_REF_CALIBRATION_VHV, 0),
+      I2C_RMW_VAR(REG_REF_CALIBRATION_PHASE, 0x7F, 1)};
+  uint8_t vars[] = {calibration->vhv_settings, calibration->phase_cal};
+  vl53l0x_result_e result =
+      vl53l0x_run_script(ref_calibration_enter_script,
+                         ARRAY_SIZE(ref_calibration_enter_script), NULL);
+  if (!result) {
+    result = vl53l0x_run_script(write_script, ARRAY_SIZE(write_script), vars);
+  }
+  if (!result) {
+    result = vl53l0x_run_script(ref_calibration_exit_script,
+                                ARRAY_SIZE(ref_calibration_exit_script), NULL);
   }
+  return result;
+}
+
+/* Timing calculations of the ranging sequence, adapted from the ST API. The
+ * timeouts are stored in macro periods (MCLKs), whose length depends on the
+ * VCSEL pulse period (in PCLKs) of the step. */
+#define VCSEL_PERIOD_DECODE(reg) (((reg) + 1) << 1)
+#define VCSEL_PERIOD_ENCODE(pclks) (((pclks) >> 1) - 1)
+#define MACRO_PERIOD_NS(pclks) ((((uint32_t)2304 * (pclks)*1655) + 500) / 1000)
+
+// Overhead of each step in the timing budget (from the ST API)
+#define TIMING_BUDGET_MIN_US (20000u)
+#define TIMING_OVERHEAD_START_US (1910u)
+#define TIMING_OVERHEAD_END_US (960u)
+#define TIMING_OVERHEAD_MSRC_US (660u)
+#define TIMING_OVERHEAD_TCC_US (590u)
+#define TIMING_OVERHEAD_DSS_US (690u)
+#define TIMING_OVERHEAD_PRE_RANGE_US (660u)
+#define TIMING_OVERHEAD_FINAL_RANGE_US (550u)
+
+struct vl53l0x_sequence_timeouts {
+  uint8_t pre_range_vcsel_period;
+  uint8_t final_range_vcsel_period;
+  uint16_t pre_range_mclks;
+  uint32_t msrc_dss_tcc_us;
+  uint32_t pre_range_us;
+  uint32_t final_range_us;
+};
+
+// Register format is (LSB * 2^MSB) + 1
+static uint16_t vl53l0x_decode_timeout(uint16_t reg) {
+  return (uint16_t)((reg & 0x00FF) << ((reg & 0xFF00) >> 8)) + 1;
+}
+
+static uint16_t vl53l0x_encode_timeout(uint32_t mclks) {
+  if (mclks == 0) {
+    return 0;
+  }
+  uint32_t lsb = mclks - 1;
+  uint16_t msb = 0;
+  while (lsb & 0xFFFFFF00) {
+    lsb >>= 1;
+    msb++;
+  }
+  return (msb << 8) | (lsb & 0xFF);
+}
+
+static uint32_t vl53l0x_mclks_to_us(uint16_t mclks, uint8_t vcsel_period) {
+  const uint32_t macro_period_ns = MACRO_PERIOD_NS(vcsel_period);
+  return ((mclks * macro_period_ns) + 500) / 1000;
+}
 
-  if (i2c_write_addr8_data8(REG_SYSRANGE_START, 0x00)) {
+static uint32_t vl53l0x_us_to_mclks(uint32_t us, uint8_t vcsel_period) {
+  const uint32_t macro_period_ns = MACRO_PERIOD_NS(vcsel_period);
+  return ((us * 1000) + (macro_period_ns / 2)) / macro_period_ns;
+}
+
+// Assumes I2C address is set already
+static vl53l0x_result_e
+vl53l0x_get_sequence_timeouts(uint8_t sequence_steps,
+                              struct vl53l0x_sequence_timeouts *timeouts) {
+  uint8_t pre_range_vcsel_reg = 0;
+  uint8_t final_range_vcsel_reg = 0;
+  uint8_t msrc_reg = 0;
+  uint16_t pre_range_reg = 0;
+  uint16_t final_range_reg = 0;
+  if (i2c_read_addr8_data8(REG_PRE_RANGE_CONFIG_VCSEL_PERIOD,
+                           &pre_range_vcsel_reg) ||
+      i2c_read_addr8_data8(REG_FINAL_RANGE_CONFIG_VCSEL_PERIOD,
+                           &final_range_vcsel_reg) ||
+      i2c_read_addr8_data8(REG_MSRC_CONFIG_TIMEOUT_MACROP, &msrc_reg) ||
+      i2c_read_addr8_data16(REG_PRE_RANGE_CONFIG_TIMEOUT_MACROP_HI,
+                            &pre_range_reg) ||
+      i2c_read_addr8_data16(REG_FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI,
+                            &final_range_reg)) {
     return VL53L0X_RESULT_ERROR_I2C;
   }
+
+  timeouts->pre_range_vcsel_period = VCSEL_PERIOD_DECODE(pre_range_vcsel_reg);
+  timeouts->final_range_vcsel_period =
+      VCSEL_PERIOD_DECODE(final_range_vcsel_reg);
+  timeouts->msrc_dss_tcc_us =
+      vl53l0x_mclks_to_us(msrc_reg + 1, timeouts->pre_range_vcsel_period);
+  timeouts->pre_range_mclks = vl53l0x_decode_timeout(pre_range_reg);
+  timeouts->pre_range_us = vl53l0x_mclks_to_us(
+      timeouts->pre_range_mclks, timeouts->pre_range_vcsel_period);
+  // The final range timeout includes the pre range timeout
+  uint16_t final_range_mclks = vl53l0x_decode_timeout(final_range_reg);
+  if (sequence_steps & VL53L0X_SEQUENCE_STEP_PRE_RANGE) {
+    final_range_mclks -= timeouts->pre_range_mclks;
+  }
+  timeouts->final_range_us = vl53l0x_mclks_to_us(
+      final_range_mclks, timeouts->final_range_vcsel_period);
   return VL53L0X_RESULT_OK;
 }
 
-/* Temperature calibration needs to be run again if the temperature changes by
- * more than 8 degrees according to the datasheet. */
-static vl53l0x_result_e vl53l0x_perform_ref_calibration(void) {
+/* Sets the VCSEL periods and the register values that depend on them, and
+ * rescales the step timeouts to keep their length in time.
+ * Assumes I2C address is set already */
+static vl53l0x_result_e
+vl53l0x_set_vcsel_periods(const struct vl53l0x_profile *profile) {
+  // Indexed by (period - 12) / 2
+  static const uint8_t pre_range_valid_phase_high[] = {0x18, 0x30, 0x40,
+                                                       0x50};
+  // Indexed by (period - 8) / 2
+  static const uint8_t final_range_valid_phase_high[] = {0x10, 0x28, 0x38,
+                                                         0x48};
+  static const uint8_t final_range_phasecal_timeout[] = {0x0C, 0x09, 0x08,
+                                                         0x07};
+  const uint8_t pre_range_period = profile->pre_range_vcsel_period;
+  const uint8_t final_range_period = profile->final_range_vcsel_period;
+  const uint8_t pre_idx = (pre_range_period - 12) / 2;
+  const uint8_t final_idx = (final_range_period - 8) / 2;
+
+  struct vl53l0x_sequence_timeouts timeouts;
   vl53l0x_result_e result =
-      vl53l0x_perform_single_ref_calibration(VL53L0X_CALIBRATION_TYPE_VHV);
+      vl53l0x_get_sequence_timeouts(profile->sequence_steps, &timeouts);
   if (result) {
     return result;
   }
-  result =
-      vl53l0x_perform_single_ref_calibration(VL53L0X_CALIBRATION_TYPE_PHASE);
+
+  const uint16_t pre_range_timeout = vl53l0x_encode_timeout(
+      vl53l0x_us_to_mclks(timeouts.pre_range_us, pre_range_period));
+  const uint32_t msrc_mclks =
+      vl53l0x_us_to_mclks(timeouts.msrc_dss_tcc_us, pre_range_period);
+  uint32_t final_range_mclks =
+      vl53l0x_us_to_mclks(timeouts.final_range_us, final_range_period);
+  if (profile->sequence_steps & VL53L0X_SEQUENCE_STEP_PRE_RANGE) {
+    final_range_mclks += timeouts.pre_range_mclks;
+  }
+  const uint16_t final_range_timeout =
+      vl53l0x_encode_timeout(final_range_mclks);
+
+  static const struct i2c_script_op vcsel_script[] = {
+      I2C_WRITE_VAR(REG_PRE_RANGE_CONFIG_VALID_PHASE_HIGH, 0),
+      I2C_WRITE(REG_PRE_RANGE_CONFIG_VALID_PHASE_LOW, 0x08),
+      I2C_WRITE_VAR(REG_PRE_RANGE_CONFIG_VCSEL_PERIOD, 1),
+      I2C_WRITE_VAR(REG_PRE_RANGE_CONFIG_TIMEOUT_MACROP_HI, 2),
+      I2C_WRITE_VAR(REG_PRE_RANGE_CONFIG_TIMEOUT_MACROP_HI + 1, 3),
+      I2C_WRITE_VAR(REG_MSRC_CONFIG_TIMEOUT_MACROP, 4),
+      I2C_WRITE_VAR(REG_FINAL_RANGE_CONFIG_VALID_PHASE_HIGH, 5),
+      I2C_WRITE(REG_FINAL_RANGE_CONFIG_VALID_PHASE_LOW, 0x08),
+      I2C_WRITE_VAR(REG_GLOBAL_CONFIG_VCSEL_WIDTH, 6),
+      I2C_WRITE_VAR(REG_ALGO_PHASECAL_CONFIG_TIMEOUT, 7),
+      I2C_WRITE(0xFF, 0x01),
+      I2C_WRITE_VAR(REG_ALGO_PHASECAL_LIM, 8),
+      I2C_WRITE(0xFF, 0x00),
+      I2C_WRITE_VAR(REG_FINAL_RANGE_CONFIG_VCSEL_PERIOD, 9),
+      I2C_WRITE_VAR(REG_FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI, 10),
+      I2C_WRITE_VAR(REG_FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI + 1, 11)};
+  uint8_t vars[] = {
+      pre_range_valid_phase_high[pre_idx],
+      VCSEL_PERIOD_ENCODE(pre_range_period),
+      pre_range_timeout >> 8,
+      pre_range_timeout & 0xFF,
+      msrc_mclks > 256 ? 255 : msrc_mclks - 1,
+      final_range_valid_phase_high[final_idx],
+      final_range_period == 8 ? 0x02 : 0x03,
+      final_range_phasecal_timeout[final_idx],
+      final_range_period == 8 ? 0x30 : 0x20,
+      VCSEL_PERIOD_ENCODE(final_range_period),
+      final_range_timeout >> 8,
+      final_range_timeout & 0xFF,
+  };
+  return vl53l0x_run_script(vcsel_script, ARRAY_SIZE(vcsel_script), vars);
+}
+
+/* The final range step gets what's left of the budget after the other
+ * enabled steps. Assumes I2C address is set already */
+static vl53l0x_result_e vl53l0x_set_timing_budget(uint32_t budget_us,
+                                                  uint8_t sequence_steps) {
+  struct vl53l0x_sequence_timeouts timeouts;
+  vl53l0x_result_e result =
+      vl53l0x_get_sequence_timeouts(sequence_steps, &timeouts);
   if (result) {
     return result;
   }
-  // Restore sequence steps enabled
-  result = vl53l0x_set_sequence_steps_enabled(RANGE_SEQUENCE_STEP_DSS +
-                                              RANGE_SEQUENCE_STEP_PRE_RANGE +
-                                              RANGE_SEQUENCE_STEP_FINAL_RANGE);
-  return result;
+
+  uint32_t used_us = TIMING_OVERHEAD_START_US + TIMING_OVERHEAD_END_US;
+  if (sequence_steps & VL53L0X_SEQUENCE_STEP_TCC) {
+    used_us += timeouts.msrc_dss_tcc_us + TIMING_OVERHEAD_TCC_US;
+  }
+  if ((sequence_steps & VL53L0X_SEQUENCE_STEP_DSS) ==
+      VL53L0X_SEQUENCE_STEP_DSS) {
+    used_us += 2 * (timeouts.msrc_dss_tcc_us + TIMING_OVERHEAD_DSS_US);
+  } else if (sequence_steps & VL53L0X_SEQUENCE_STEP_MSRC) {
+    used_us += timeouts.msrc_dss_tcc_us + TIMING_OVERHEAD_MSRC_US;
+  }
+  if (sequence_steps & VL53L0X_SEQUENCE_STEP_PRE_RANGE) {
+    used_us += timeouts.pre_range_us + TIMING_OVERHEAD_PRE_RANGE_US;
+  }
+  if (!(sequence_steps & VL53L0X_SEQUENCE_STEP_FINAL_RANGE)) {
+    return VL53L0X_RESULT_OK;
+  }
+  used_us += TIMING_OVERHEAD_FINAL_RANGE_US;
+  if (used_us > budget_us) {
+    return VL53L0X_RESULT_ERROR_PROFILE;
+  }
+
+  uint32_t final_range_mclks = vl53l0x_us_to_mclks(
+      budget_us - used_us, timeouts.final_range_vcsel_period);
+  if (sequence_steps & VL53L0X_SEQUENCE_STEP_PRE_RANGE) {
+    final_range_mclks += timeouts.pre_range_mclks;
+  }
+  if (i2c_write_addr8_data16(REG_FINAL_RANGE_CONFIG_TIMEOUT_MACROP_HI,
+                             vl53l0x_encode_timeout(final_range_mclks))) {
+    return VL53L0X_RESULT_ERROR_I2C;
+  }
+  return VL53L0X_RESULT_OK;
+}
+
+static bool vl53l0x_profile_valid(const struct vl53l0x_profile *profile) {
+  const uint8_t pre_range_period = profile->pre_range_vcsel_period;
+  const uint8_t final_range_period = profile->final_range_vcsel_period;
+  return profile->timing_budget_us >= TIMING_BUDGET_MIN_US &&
+         !IS_ODD(pre_range_period) && pre_range_period >= 12 &&
+         pre_range_period <= 18 && !IS_ODD(final_range_period) &&
+         final_range_period >= 8 && final_range_period <= 14;
 }
 
 static vl53l0x_result_e vl53l0x_configure_address(uint8_t addr) {
@@ -567,12 +923,12 @@ static vl53l0x_result_e vl53l0x_init_address(vl53l0x_idx_e idx) {
   vl53l0x_set_hardware_standby(idx, false);
   i2c_set_slave_address(VL53L0X_DEFAULT_ADDRESS);
 
-  /* The datasheet doesn't say how long we must wait to leave hw standby,
-   * but using the same delay as vl6180x seems to work fine. */
-  /* TODO: Tune this delay */
-  __delay_cycles(10000);
-
-  vl53l0x_result_e result = device_is_booted();
+  // The sensor doesn't respond (NACK) until it has booted
+  const uint32_t start_us = timestamp_us();
+  vl53l0x_result_e result = VL53L0X_RESULT_OK;
+  do {
+    result = device_is_booted();
+  } while (result && timestamp_elapsed_us(start_us) < VL53L0X_BOOT_TIMEOUT_US);
   if (result) {
     return result;
   }
@@ -586,82 +942,156 @@ static vl53l0x_result_e vl53l0x_init_addresses(void) {
   // Default IO config should put all sensors in hardware standby
   vl53l0x_assert_xshut_pins();
 
-  // Wake each sensor up one by one and set a unique address for each one
-  vl53l0x_result_e result = vl53l0x_init_address(VL53L0X_IDX_FRONT);
-  if (result) {
-    return result;
-  }
-#if defined(NSUMO)
-  result = vl53l0x_init_address(VL53L0X_IDX_LEFT);
-  if (result) {
-    return result;
-  }
-  result = vl53l0x_init_address(VL53L0X_IDX_RIGHT);
-  if (result) {
-    return result;
-  }
-  result = vl53l0x_init_address(VL53L0X_IDX_FRONT_LEFT);
-  if (result) {
-    return result;
-  }
-  result = vl53l0x_init_address(VL53L0X_IDX_FRONT_RIGHT);
-  if (result) {
-    return result;
+  /* Wake each sensor up one by one and set a unique address for each one. A
+   * sensor that doesn't answer (dead or unplugged) is put back in standby and
+   * skipped from then on. */
+  for (vl53l0x_idx_e idx = 0; idx < ARRAY_SIZE(vl53l0x_cfgs); idx++) {
+    if (vl53l0x_init_address(idx)) {
+      vl53l0x_set_hardware_standby(idx, true);
+      continue;
+    }
+    present_mask |= VL53L0X_MASK(idx);
   }
-#endif
-  return VL53L0X_RESULT_OK;
+  return present_mask ? VL53L0X_RESULT_OK : VL53L0X_RESULT_ERROR_BOOT;
 }
 
-static vl53l0x_result_e vl53l0x_init_config(vl53l0x_idx_e idx) {
+/* Retrieves the calibration data from the sensor if not cached (NVM reads),
+ * and starts the VHV calibration without waiting for it. */
+static vl53l0x_result_e vl53l0x_init_config(vl53l0x_idx_e idx, bool cached) {
+  struct vl53l0x_calibration *calibration = &calibrations[idx];
   i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
   vl53l0x_result_e result = vl53l0x_data_init();
   if (result) {
     return result;
   }
-  result = vl53l0x_static_init();
-  if (result) {
-    return result;
+  if (!cached) {
+    result = vl53l0x_get_stop_variable(&calibration->stop_variable);
+    if (result) {
+      return result;
+    }
+    result = vl53l0x_get_spad_map_from_nvm(calibration->spad_map,
+                                           calibration->part_uid);
+    if (result) {
+      return result;
+    }
   }
-  result = vl53l0x_perform_ref_calibration();
+  result = vl53l0x_static_init(calibration->spad_map);
   if (result) {
     return result;
   }
+  if (cached) {
+    return vl53l0x_set_ref_calibration(calibration);
+  }
+  return vl53l0x_start_ref_calibration(VL53L0X_CALIBRATION_TYPE_VHV);
+}
+
+// TEMPERATURE_UNKNOWN until the ADC has sampled the temperature sensor
+static int8_t vl53l0x_get_temperature(void) {
+  int16_t temperature_c = 0;
+  return adc_get_temperature_c(&temperature_c) ? (int8_t)temperature_c
+                                               : TEMPERATURE_UNKNOWN;
+}
 
-  if (idx == VL53L0X_IDX_FRONT) {
-    vl53l0x_configure_front_sensor_interrupt();
+/* Finishes the calibration started by vl53l0x_init_config, each step of it
+ * is done for all sensors before the next so that they calibrate at the same
+ * time. */
+static vl53l0x_result_e vl53l0x_init_calibration(uint8_t mask) {
+  for (vl53l0x_idx_e idx = 0; idx < ARRAY_SIZE(vl53l0x_cfgs); idx++) {
+    if (!(mask & VL53L0X_MASK(idx))) {
+      continue;
+    }
+    i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
+    vl53l0x_result_e result = vl53l0x_finish_ref_calibration();
+    if (result) {
+      return result;
+    }
+    result = vl53l0x_start_ref_calibration(VL53L0X_CALIBRATION_TYPE_PHASE);
+    if (result) {
+      return result;
+    }
+  }
+  for (vl53l0x_idx_e idx = 0; idx < ARRAY_SIZE(vl53l0x_cfgs); idx++) {
+    if (!(mask & VL53L0X_MASK(idx))) {
+      continue;
+    }
+    i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
+    vl53l0x_result_e result = vl53l0x_finish_ref_calibration();
+    if (result) {
+      return result;
+    }
+    // Restore sequence steps enabled
+    result = vl53l0x_set_sequence_steps_enabled(SEQUENCE_STEPS_DEFAULT);
+    if (result) {
+      return result;
+    }
+    result = vl53l0x_get_ref_calibration(&calibrations[idx]);
+    if (result) {
+      return result;
+    }
+    calibrations[idx].temperature_c = vl53l0x_get_temperature();
+    calibrations[idx].valid = true;
   }
   return VL53L0X_RESULT_OK;
 }
 
+/* In back-to-back mode the sensor starts a new measurement as soon as the
+ * previous one is done, so this is only needed once. The start bit is only
+ * set in single shot mode, and clears when the measurement has started. */
+static vl53l0x_result_e vl53l0x_start_sysrange_mode(vl53l0x_idx_e idx,
+                                                    uint8_t mode) {
+  i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
+  static const struct i2c_script_op sysrange_script[] = {
+      I2C_WRITE(0x80, 0x01),
+      I2C_WRITE(0xFF, 0x01),
+      I2C_WRITE(0x00, 0x00),
+      I2C_WRITE_VAR(0x91, 0),
+      I2C_WRITE(0x00, 0x01),
+      I2C_WRITE(0xFF, 0x00),
+      I2C_WRITE(0x80, 0x00),
+      I2C_WRITE_VAR(REG_SYSRANGE_START, 1),
+      I2C_POLL_CLEAR(REG_SYSRANGE_START, SYSRANGE_MODE_SINGLESHOT,
+                     VL53L0X_POLL_TIMEOUT_MS)};
+  uint8_t vars[] = {calibrations[idx].stop_variable, mode};
+  waiting_since_us[idx] = timestamp_us();
+  return vl53l0x_run_script(sysrange_script, ARRAY_SIZE(sysrange_script),
+                            vars);
+}
+
 static vl53l0x_result_e vl53l0x_start_sysrange(vl53l0x_idx_e idx) {
+  return vl53l0x_start_sysrange_mode(idx, SYSRANGE_MODE_SINGLESHOT);
+}
+
+/* Writing single shot mode stops back-to-back mode after the ongoing one (and
+ * timed mode) */
+static vl53l0x_result_e vl53l0x_stop_sysrange_continuous(vl53l0x_idx_e idx) {
   i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
-  const struct i2c_8reg sysrange_regs[] = {{0x80, 0x01}, {0xFF, 0x01},
-                                           {0x00, 0x00}, {0x00, 0x01},
-                                           {0xFF, 0x00}, {0x80, 0x00}};
-  vl53l0x_result_e result = vl53l0x_write_8regs(sysrange_regs, 3);
-  if (result) {
-    return result;
-  }
-  if (i2c_write_addr8_data8(0x91, stop_variable)) {
+  static const struct i2c_script_op stop_script[] = {
+      I2C_WRITE(REG_SYSRANGE_START, SYSRANGE_MODE_SINGLESHOT),
+      I2C_WRITE(0xFF, 0x01),
+      I2C_WRITE(0x00, 0x00),
+      I2C_WRITE(0x91, 0x00),
+      I2C_WRITE(0x00, 0x01),
+      I2C_WRITE(0xFF, 0x00)};
+  return vl53l0x_run_script(stop_script, ARRAY_SIZE(stop_script), NULL);
+}
+
+/* In timed mode a measurement starts every period. The period register counts
+ * in oscillator ticks, scaled from ms as in the ST API. */
+static vl53l0x_result_e
+vl53l0x_set_intermeasurement_period(vl53l0x_idx_e idx, uint16_t period_ms) {
+  i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
+  uint16_t osc_calibrate_val = 0;
+  if (i2c_read_addr8_data16(REG_OSC_CALIBRATE_VAL, &osc_calibrate_val)) {
     return VL53L0X_RESULT_ERROR_I2C;
   }
-  result =
-      vl53l0x_write_8regs(sysrange_regs + 3, ARRAY_SIZE(sysrange_regs) - 3);
-  if (result) {
-    return result;
+  uint32_t period = period_ms;
+  if (osc_calibrate_val) {
+    period *= osc_calibrate_val;
   }
-
-  if (i2c_write_addr8_data8(REG_SYSRANGE_START, 0x01)) {
+  if (i2c_write_addr8_data32(REG_SYSTEM_INTERMEASUREMENT_PERIOD, period)) {
     return VL53L0X_RESULT_ERROR_I2C;
   }
-
-  uint8_t sysrange_start = 0;
-  i2c_result_e i2c_result = I2C_RESULT_OK;
-  do {
-    i2c_result = i2c_read_addr8_data8(REG_SYSRANGE_START, &sysrange_start);
-  } while (i2c_result == I2C_RESULT_OK && (sysrange_start & 0x01));
-  return i2c_result == I2C_RESULT_OK ? VL53L0X_RESULT_OK
-                                     : VL53L0X_RESULT_ERROR_I2C;
+  return VL53L0X_RESULT_OK;
 }
 
 // Assumes I2C address is set already
@@ -684,205 +1114,1142 @@ static vl53l0x_result_e vl53l0x_pollwait_sysrange(void) {
                                      : VL53L0X_RESULT_ERROR_I2C;
 }
 
-static bool vl53l0x_is_sysrange_done(vl53l0x_idx_e idx) {
-#if defined(LAUNCHPAD)
-  if (idx != VL53L0X_IDX_FRONT) {
+// Reads the result of a finished measurement and clears the interrupt
+/* Same classification as the range status of the ST API. The statuses it
+ * doesn't list (e.g. SNR and sigma) are only checked against limits in the
+ * ST API, and are considered valid. */
+static bool vl53l0x_range_status_valid(vl53l0x_range_status_e status) {
+  switch (status) {
+  case VL53L0X_RANGE_STATUS_VCSEL_CONTINUITY_FAIL:
+  case VL53L0X_RANGE_STATUS_VCSEL_WATCHDOG_FAIL:
+  case VL53L0X_RANGE_STATUS_NO_VHV_VALUE_FOUND:
+    // Hardware fail
+    return false;
+  case VL53L0X_RANGE_STATUS_RANGE_PHASE_CHECK:
+  case VL53L0X_RANGE_STATUS_PHASE_CONSISTENCY:
+    // Phase fail (wrapped around, target beyond the max range)
+    return false;
+  case VL53L0X_RANGE_STATUS_TCC:
+  case VL53L0X_RANGE_STATUS_MIN_CLIP:
+    // Min range fail
+    return false;
+  case VL53L0X_RANGE_STATUS_MSRC_NO_TARGET:
+  case VL53L0X_RANGE_STATUS_RANGE_IGNORE_THRESHOLD:
+    // Signal fail
+    return false;
+  default:
     return true;
   }
-#endif
+}
+
+/* The result block starts at REG_RESULT_RANGE_STATUS, it's read in one burst
+ * instead of a transaction per field (same layout as in the ST API). i2c_read
+ * stores the bytes reversed (last register first), so the fields are
+ * accessed by their register offset from the end of the buffer. */
+#define RESULT_BLOCK_BYTE(block, i)                                            \
+  ((block)[VL53L0X_RESULT_BLOCK_SIZE - 1 - (i)])
+#define RESULT_BLOCK_UINT16(block, i)                                          \
+  (((uint16_t)RESULT_BLOCK_BYTE(block, i) << 8) |                             \
+   RESULT_BLOCK_BYTE(block, (i) + 1))
+
+void vl53l0x_decode_result_block(const uint8_t *block,
+                                 struct vl53l0x_sample *sample) {
+  sample->status = (RESULT_BLOCK_BYTE(block, 0) & 0x78) >> 3;
+  sample->spad_count = RESULT_BLOCK_UINT16(block, 2);
+  sample->signal_rate = RESULT_BLOCK_UINT16(block, 6);
+  sample->ambient_rate = RESULT_BLOCK_UINT16(block, 8);
+  sample->range = RESULT_BLOCK_UINT16(block, 10);
+
+  /* Reject bad measurements, their range is meaningless (phantom targets).
+   * 8190 or 8191 may be returned when obstacle is out of range. */
+  if (!vl53l0x_range_status_valid(sample->status) || sample->range == 8190 ||
+      sample->range == 8191) {
+    sample->range = VL53L0X_OUT_OF_RANGE;
+  }
+}
+
+// timestamp_us is when the sample was done (see struct vl53l0x_sample)
+static vl53l0x_result_e vl53l0x_read_result(vl53l0x_idx_e idx,
+                                            struct vl53l0x_sample *sample,
+                                            uint32_t timestamp_us) {
   i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
-  uint8_t interrupt_status = 0;
-  const i2c_result_e i2c_result =
-      i2c_read_addr8_data8(REG_RESULT_INTERRUPT_STATUS, &interrupt_status);
-  return i2c_result == I2C_RESULT_OK && (interrupt_status & 0x07);
+
+  const uint8_t addr = REG_RESULT_RANGE_STATUS;
+  uint8_t block[VL53L0X_RESULT_BLOCK_SIZE];
+  if (i2c_read(&addr, 1, block, VL53L0X_RESULT_BLOCK_SIZE)) {
+    return VL53L0X_RESULT_ERROR_I2C;
+  }
+  vl53l0x_decode_result_block(block, sample);
+  sample->timestamp_us = timestamp_us;
+  sample->seq = ++sample_seqs[idx];
+
+  return vl53l0x_clear_sysrange_interrupt();
 }
 
-static vl53l0x_result_e vl53l0x_read_range(vl53l0x_idx_e idx, uint16_t *range) {
+static vl53l0x_result_e vl53l0x_read_sample(vl53l0x_idx_e idx,
+                                            struct vl53l0x_sample *sample) {
   i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
 
   vl53l0x_result_e result = vl53l0x_pollwait_sysrange();
   if (result) {
     return result;
   }
+  // Polled, so the time it's done is about now
+  return vl53l0x_read_result(idx, sample, timestamp_us());
+}
 
-  if (i2c_read_addr8_data16(REG_RESULT_RANGE_STATUS + 10, range)) {
-    return VL53L0X_RESULT_ERROR_I2C;
-  }
+vl53l0x_result_e vl53l0x_read_sample_single(vl53l0x_idx_e idx,
+                                            struct vl53l0x_sample *sample) {
+  ASSERT(initialized);
+  if (continuous) {
+    return VL53L0X_RESULT_ERROR_MEASURE_ONGOING;
+  }
+  if (!(present_mask & VL53L0X_MASK(idx)) ||
+      (resetting_mask & VL53L0X_MASK(idx))) {
+    return VL53L0X_RESULT_ERROR_NOT_PRESENT;
+  }
+  // It would never be done if beyond the threshold
+  if (threshold_mm) {
+    return VL53L0X_RESULT_ERROR_THRESHOLD_MODE;
+  }
+  vl53l0x_result_e result = vl53l0x_start_sysrange(idx);
+  if (result) {
+    return result;
+  }
+  result = vl53l0x_read_sample(idx, sample);
+  // Polled, so ignore the interrupt
+  sample_ready[idx] = false;
+  return result;
+}
 
-  if (i2c_write_addr8_data8(REG_SYSTEM_INTERRUPT_CLEAR, 0x01)) {
+vl53l0x_result_e vl53l0x_read_range_single(vl53l0x_idx_e idx, uint16_t *range) {
+  struct vl53l0x_sample sample;
+  const vl53l0x_result_e result = vl53l0x_read_sample_single(idx, &sample);
+  if (!result) {
+    *range = sample.range;
+  }
+  return result;
+}
+
+/* Sensors measured by the *_multiple and *_continuous functions by default
+ * (left and right are skipped, since they are mounted badly). The front
+ * overlaps the two others, so none of them is independent (see
+ * vl53l0x_schedule_init) and they are staggered in two slots. */
+#define ACTIVE_MASK_DEFAULT                                                    \
+  (VL53L0X_MASK(VL53L0X_IDX_FRONT) | VL53L0X_MASK(VL53L0X_IDX_FRONT_LEFT) |    \
+   VL53L0X_MASK(VL53L0X_IDX_FRONT_RIGHT))
+
+// The active sensors, as an array to loop over them without checking the mask
+static vl53l0x_idx_e active_idxs[VL53L0X_IDX_COUNT];
+static uint8_t active_count = 0;
+
+/* Sensors whose fields of view overlap, so measuring at the same time would
+ * corrupt both readings (crosstalk). Must be symmetric. */
+static const uint8_t overlap_masks[VL53L0X_IDX_COUNT] = {
+    [VL53L0X_IDX_FRONT] = VL53L0X_MASK(VL53L0X_IDX_FRONT_LEFT) |
+                          VL53L0X_MASK(VL53L0X_IDX_FRONT_RIGHT),
+    [VL53L0X_IDX_LEFT] = VL53L0X_MASK(VL53L0X_IDX_FRONT_LEFT),
+    [VL53L0X_IDX_RIGHT] = VL53L0X_MASK(VL53L0X_IDX_FRONT_RIGHT),
+    [VL53L0X_IDX_FRONT_LEFT] =
+        VL53L0X_MASK(VL53L0X_IDX_FRONT) | VL53L0X_MASK(VL53L0X_IDX_LEFT),
+    [VL53L0X_IDX_FRONT_RIGHT] =
+        VL53L0X_MASK(VL53L0X_IDX_FRONT) | VL53L0X_MASK(VL53L0X_IDX_RIGHT),
+};
+
+/* Scheduler of the *_multiple functions. Sensors that don't overlap any other
+ * measured sensor run independently (restarted as soon as they're done, or
+ * free-running in continuous mode). The others are divided into slots of
+ * sensors that don't overlap each other, which take turns: all sensors of a
+ * slot measure in parallel and the next slot starts when they're all done. */
+static uint8_t independent_mask = 0;
+static uint8_t slot_masks[VL53L0X_IDX_COUNT] = {0};
+static uint8_t slot_count = 0;
+static uint8_t slot = 0;
+static uint8_t slot_pending = 0; // Sensors of the current slot not read yet
+
+/* In continuous mode the slots take turns in time instead: each gets a window
+ * (the longest timing budget and a margin) and its sensors free-run in timed
+ * mode, with a period of all windows, so they measure in their window without
+ * being restarted. The oscillators of the sensors drift apart, so a sensor
+ * whose measurement gets too close to one of an overlapping sensor is stopped,
+ * and started again at the start of its window. */
+static uint32_t stagger_window_us = 0;
+static uint16_t stagger_period_ms = 0;
+static uint32_t slot_started_us = 0;
+static uint8_t staggered_mask = 0; // Running in timed mode
+static uint32_t stagger_ready_us[VL53L0X_IDX_COUNT] = {0}; // 0 until signaled
+
+// For the effective update rate (moving average of the sample period)
+static uint32_t last_sample_us[VL53L0X_IDX_COUNT] = {0};
+static uint32_t sample_period_us[VL53L0X_IDX_COUNT] = {0};
+
+// Greedy assignment of the overlapping sensors to slots
+static void vl53l0x_schedule_init(void) {
+  independent_mask = 0;
+  slot_count = 0;
+  for (uint8_t s = 0; s < VL53L0X_IDX_COUNT; s++) {
+    slot_masks[s] = 0;
+  }
+  for (uint8_t i = 0; i < active_count; i++) {
+    const vl53l0x_idx_e idx = active_idxs[i];
+    const uint8_t overlaps = overlap_masks[idx] & active_mask;
+    if (!overlaps) {
+      independent_mask |= VL53L0X_MASK(idx);
+      continue;
+    }
+    uint8_t s = 0;
+    while (s < slot_count && (slot_masks[s] & overlaps)) {
+      s++;
+    }
+    slot_masks[s] |= VL53L0X_MASK(idx);
+    if (s == slot_count) {
+      slot_count++;
+    }
+  }
+}
+
+/* Counts the failure, the sensor is either restarted on timeout or reset (see
+ * vl53l0x_update_reset). It no longer holds up its slot. */
+static void vl53l0x_sensor_failed(vl53l0x_idx_e idx) {
+  struct vl53l0x_health *sensor_health = &health[idx];
+  sensor_health->failures++;
+  sensor_health->consecutive_failures++;
+  slot_pending &= ~VL53L0X_MASK(idx);
+  if (sensor_health->consecutive_failures >= FAILURES_BEFORE_RESET) {
+    sensor_health->resetting = true;
+    resetting_mask |= VL53L0X_MASK(idx);
+  }
+}
+
+static void vl53l0x_start_sensors(uint8_t mask, uint8_t mode) {
+  mask &= ~resetting_mask;
+  for (uint8_t i = 0; i < active_count; i++) {
+    const vl53l0x_idx_e idx = active_idxs[i];
+    if (!(mask & VL53L0X_MASK(idx))) {
+      continue;
+    }
+    sample_ready[idx] = false;
+    if (vl53l0x_start_sysrange_mode(idx, mode)) {
+      vl53l0x_sensor_failed(idx);
+    }
+  }
+}
+
+static void vl53l0x_start_staggered(uint8_t mask) {
+  mask &= ~resetting_mask;
+  for (uint8_t i = 0; i < active_count; i++) {
+    const vl53l0x_idx_e idx = active_idxs[i];
+    if (!(mask & VL53L0X_MASK(idx))) {
+      continue;
+    }
+    sample_ready[idx] = false;
+    stagger_ready_us[idx] = 0;
+    // Lost if the sensor has been reset, so written on each start
+    if (vl53l0x_set_intermeasurement_period(idx, stagger_period_ms) ||
+        vl53l0x_start_sysrange_mode(idx, SYSRANGE_MODE_TIMED)) {
+      vl53l0x_sensor_failed(idx);
+      continue;
+    }
+    staggered_mask |= VL53L0X_MASK(idx);
+  }
+}
+
+/* In continuous mode only the sensors of the slot that aren't running (yet, or
+ * anymore) are started */
+static void vl53l0x_start_slot(uint8_t next_slot) {
+  slot = next_slot;
+  if (continuous) {
+    slot_pending = 0;
+    slot_started_us = timestamp_us();
+    vl53l0x_start_staggered(slot_masks[slot] & ~staggered_mask);
+    return;
+  }
+  slot_pending = slot_masks[slot] & ~resetting_mask;
+  vl53l0x_start_sensors(slot_masks[slot], SYSRANGE_MODE_SINGLESHOT);
+}
+
+static bool vl53l0x_slot_done(void) {
+  if (continuous) {
+    return timestamp_elapsed_us(slot_started_us) >= stagger_window_us;
+  }
+  return !slot_pending;
+}
+
+static void vl53l0x_start_schedule(uint8_t independent_mode) {
+  status_multiple = STATUS_MULTIPLE_MEASURING;
+  vl53l0x_start_sensors(independent_mask, independent_mode);
+  if (slot_count) {
+    vl53l0x_start_slot(0);
+  }
+}
+
+vl53l0x_result_e vl53l0x_start_measuring_multiple(void) {
+  ASSERT(initialized);
+  if (status_multiple == STATUS_MULTIPLE_MEASURING) {
+    return VL53L0X_RESULT_ERROR_MEASURE_ONGOING;
+  }
+  vl53l0x_start_schedule(SYSRANGE_MODE_SINGLESHOT);
+  return VL53L0X_RESULT_OK;
+}
+
+static const struct vl53l0x_profile profiles[VL53L0X_PROFILE_COUNT] = {
+    [VL53L0X_PROFILE_DEFAULT] = {.timing_budget_us = 33000,
+                                 .pre_range_vcsel_period = 14,
+                                 .final_range_vcsel_period = 10,
+                                 .sequence_steps = SEQUENCE_STEPS_DEFAULT,
+                                 .signal_rate_limit = VL53L0X_MCPS(0.25)},
+    [VL53L0X_PROFILE_HIGH_SPEED] = {.timing_budget_us = 20000,
+                                    .pre_range_vcsel_period = 14,
+                                    .final_range_vcsel_period = 10,
+                                    .sequence_steps =
+                                        VL53L0X_SEQUENCE_STEP_PRE_RANGE +
+                                        VL53L0X_SEQUENCE_STEP_FINAL_RANGE,
+                                    .signal_rate_limit = VL53L0X_MCPS(0.25)},
+    [VL53L0X_PROFILE_LONG_RANGE] = {.timing_budget_us = 33000,
+                                    .pre_range_vcsel_period = 18,
+                                    .final_range_vcsel_period = 14,
+                                    .sequence_steps = SEQUENCE_STEPS_DEFAULT,
+                                    .signal_rate_limit = VL53L0X_MCPS(0.1)},
+};
+
+// Kept to apply them again when a sensor is reset
+static struct vl53l0x_profile custom_profiles[VL53L0X_IDX_COUNT];
+static uint8_t custom_profile_mask = 0;
+
+static uint32_t vl53l0x_timing_budget_us(vl53l0x_idx_e idx) {
+  return (custom_profile_mask & VL53L0X_MASK(idx))
+             ? custom_profiles[idx].timing_budget_us
+             : profiles[VL53L0X_PROFILE_DEFAULT].timing_budget_us;
+}
+
+// All but the phase calibration, see vl53l0x_apply_profile
+static vl53l0x_result_e
+vl53l0x_configure_profile(vl53l0x_idx_e idx,
+                          const struct vl53l0x_profile *profile) {
+  i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
+
+  vl53l0x_result_e result =
+      vl53l0x_set_sequence_steps_enabled(profile->sequence_steps);
+  if (result) {
+    return result;
+  }
+  if (i2c_write_addr8_data16(REG_FINAL_RANGE_CONFIG_MIN_COUNT_RATE_RTN_LIMIT,
+                             profile->signal_rate_limit)) {
     return VL53L0X_RESULT_ERROR_I2C;
   }
+  result = vl53l0x_set_vcsel_periods(profile);
+  if (result) {
+    return result;
+  }
+  return vl53l0x_set_timing_budget(profile->timing_budget_us,
+                                   profile->sequence_steps);
+}
 
-  // 8190 or 8191 may be returned when obstacle is out of range.
-  if (*range == 8190 || *range == 8191) {
-    *range = VL53L0X_OUT_OF_RANGE;
+static vl53l0x_result_e
+vl53l0x_apply_profile(vl53l0x_idx_e idx,
+                      const struct vl53l0x_profile *profile) {
+  vl53l0x_result_e result = vl53l0x_configure_profile(idx, profile);
+  if (result) {
+    return result;
   }
 
-  result = vl53l0x_clear_sysrange_interrupt();
-  return result;
+  // The phase calibration depends on the VCSEL period
+  result =
+      vl53l0x_perform_single_ref_calibration(VL53L0X_CALIBRATION_TYPE_PHASE);
+  if (result) {
+    return result;
+  }
+  result = vl53l0x_set_sequence_steps_enabled(profile->sequence_steps);
+  if (result) {
+    return result;
+  }
+  sensor_sequence_steps[idx] = profile->sequence_steps;
+  return VL53L0X_RESULT_OK;
 }
 
-vl53l0x_result_e vl53l0x_read_range_single(vl53l0x_idx_e idx, uint16_t *range) {
+vl53l0x_result_e vl53l0x_set_profile(vl53l0x_idx_e idx,
+                                     const struct vl53l0x_profile *profile) {
   ASSERT(initialized);
-  vl53l0x_result_e result = vl53l0x_start_sysrange(idx);
+  if (status_multiple == STATUS_MULTIPLE_MEASURING) {
+    return VL53L0X_RESULT_ERROR_MEASURE_ONGOING;
+  }
+  if (!(present_mask & VL53L0X_MASK(idx)) ||
+      (resetting_mask & VL53L0X_MASK(idx))) {
+    return VL53L0X_RESULT_ERROR_NOT_PRESENT;
+  }
+  if (!vl53l0x_profile_valid(profile)) {
+    return VL53L0X_RESULT_ERROR_PROFILE;
+  }
+  const vl53l0x_result_e result = vl53l0x_apply_profile(idx, profile);
   if (result) {
     return result;
   }
-  result = vl53l0x_read_range(idx, range);
-  return result;
+  custom_profiles[idx] = *profile;
+  custom_profile_mask |= VL53L0X_MASK(idx);
+  return VL53L0X_RESULT_OK;
 }
 
-// TODO: Verify this works after bring up real robot
-vl53l0x_result_e vl53l0x_start_measuring_multiple(void) {
+vl53l0x_result_e vl53l0x_set_preset_profile(vl53l0x_idx_e idx,
+                                            vl53l0x_profile_e profile) {
+  ASSERT(profile < VL53L0X_PROFILE_COUNT);
+  return vl53l0x_set_profile(idx, &profiles[profile]);
+}
+
+// The threshold register is in units of 2 mm (from the ST API)
+static vl53l0x_result_e vl53l0x_configure_threshold(vl53l0x_idx_e idx,
+                                                    uint16_t thresh_mm) {
+  i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
+  static const struct i2c_script_op threshold_script[] = {
+      I2C_WRITE_VAR(REG_SYSTEM_INTERRUPT_CONFIG_GPIO, 0),
+      I2C_WRITE(REG_SYSTEM_INTERRUPT_CLEAR, 0x01)};
+  if (i2c_write_addr8_data16(REG_SYSTEM_THRESH_LOW, thresh_mm / 2)) {
+    return VL53L0X_RESULT_ERROR_I2C;
+  }
+  uint8_t vars[] = {thresh_mm ? INTERRUPT_GPIO_LEVEL_LOW
+                              : INTERRUPT_GPIO_NEW_SAMPLE_READY};
+  return vl53l0x_run_script(threshold_script, ARRAY_SIZE(threshold_script),
+                            vars);
+}
+
+vl53l0x_result_e vl53l0x_set_threshold_mode(uint16_t thresh_mm) {
   ASSERT(initialized);
   if (status_multiple == STATUS_MULTIPLE_MEASURING) {
     return VL53L0X_RESULT_ERROR_MEASURE_ONGOING;
   }
-  status_multiple = STATUS_MULTIPLE_MEASURING;
-  vl53l0x_result_e result = vl53l0x_start_sysrange(VL53L0X_IDX_FRONT);
+  for (vl53l0x_idx_e idx = 0; idx < ARRAY_SIZE(vl53l0x_cfgs); idx++) {
+    // A sensor being reset is configured when it's done
+    if (!(present_mask & VL53L0X_MASK(idx)) ||
+        (resetting_mask & VL53L0X_MASK(idx))) {
+      continue;
+    }
+    const vl53l0x_result_e result = vl53l0x_configure_threshold(idx, thresh_mm);
+    if (result) {
+      return result;
+    }
+  }
+  threshold_mm = thresh_mm;
+  return VL53L0X_RESULT_OK;
+}
+
+vl53l0x_result_e vl53l0x_start_continuous(void) {
+  ASSERT(initialized);
+  if (status_multiple == STATUS_MULTIPLE_MEASURING) {
+    return VL53L0X_RESULT_ERROR_MEASURE_ONGOING;
+  }
+  // The window of a slot fits the longest measurement of the staggered sensors
+  uint32_t budget_max_us = 0;
+  for (uint8_t i = 0; i < active_count; i++) {
+    const vl53l0x_idx_e idx = active_idxs[i];
+    const uint32_t budget_us = vl53l0x_timing_budget_us(idx);
+    if (!(independent_mask & VL53L0X_MASK(idx)) && budget_us > budget_max_us) {
+      budget_max_us = budget_us;
+    }
+  }
+  stagger_window_us = budget_max_us + budget_max_us / 4;
+  stagger_period_ms = (slot_count * stagger_window_us + 999) / 1000;
+  staggered_mask = 0;
+  continuous = true;
+  vl53l0x_start_schedule(SYSRANGE_MODE_BACK_TO_BACK);
+  return VL53L0X_RESULT_OK;
+}
+
+/*
+ * The reference calibration must be redone when the temperature changes by
+ * more than 8 degrees. It's redone in the background by the *_multiple
+ * functions, one sensor at a time. When the sensor is done with a measurement
+ * the calibration is started instead of the next measurement, and each step
+ * of the calibration signals on the same interrupt as a measurement.
+ */
+#define RECALIBRATION_DRIFT_C (8)
+#define TEMPERATURE_CHECK_PERIOD_US (1000000ul)
+
+typedef enum {
+  RECALIBRATION_NONE,
+  RECALIBRATION_STOPPING, // Waiting for back-to-back ranging to stop
+  RECALIBRATION_VHV,
+  RECALIBRATION_PHASE,
+} recalibration_e;
+
+static uint8_t recalibration_mask = 0; // Sensors that have drifted
+static recalibration_e recalibration = RECALIBRATION_NONE;
+static vl53l0x_idx_e recalibration_idx = VL53L0X_IDX_FRONT;
+static uint32_t temperature_check_us = 0;
+
+static void vl53l0x_check_temperature_drift(void) {
+  if (timestamp_elapsed_us(temperature_check_us) <
+      TEMPERATURE_CHECK_PERIOD_US) {
+    return;
+  }
+  temperature_check_us = timestamp_us();
+  // Sampled in the background by the ADC (if initialized)
+  const int8_t temperature_c = vl53l0x_get_temperature();
+  if (temperature_c == TEMPERATURE_UNKNOWN) {
+    return;
+  }
+  for (uint8_t i = 0; i < active_count; i++) {
+    struct vl53l0x_calibration *calibration = &calibrations[active_idxs[i]];
+    if (calibration->temperature_c == TEMPERATURE_UNKNOWN) {
+      // Calibrated before the first temperature sample, assume no drift yet
+      calibration->temperature_c = temperature_c;
+      continue;
+    }
+    const int8_t drift_c = temperature_c - calibration->temperature_c;
+    if (ABS(drift_c) >= RECALIBRATION_DRIFT_C) {
+      recalibration_mask |= VL53L0X_MASK(active_idxs[i]);
+    }
+  }
+}
+
+static inline bool vl53l0x_recalibrating(vl53l0x_idx_e idx) {
+  return idx == recalibration_idx && (recalibration == RECALIBRATION_VHV ||
+                                      recalibration == RECALIBRATION_PHASE);
+}
+
+static vl53l0x_result_e vl53l0x_recalibration_done(vl53l0x_idx_e idx) {
+  recalibration = RECALIBRATION_NONE;
+  vl53l0x_result_e result = vl53l0x_finish_ref_calibration();
   if (result) {
     return result;
   }
-#if defined(NSUMO)
-  result = vl53l0x_start_sysrange(VL53L0X_IDX_FRONT_LEFT);
+  result = vl53l0x_set_sequence_steps_enabled(sensor_sequence_steps[idx]);
   if (result) {
     return result;
   }
-  result = vl53l0x_start_sysrange(VL53L0X_IDX_FRONT_RIGHT);
+  // Only kept in RAM, storing to flash would block too long
+  result = vl53l0x_get_ref_calibration(&calibrations[idx]);
   if (result) {
     return result;
   }
-#endif
-#if 0 // Skip left and right, since they are are mounted badly
-    result = vl53l0x_start_sysrange(VL53L0X_IDX_LEFT);
-    if (result) {
+  calibrations[idx].temperature_c = vl53l0x_get_temperature();
+  recalibration_mask &= ~VL53L0X_MASK(idx);
+  return VL53L0X_RESULT_OK;
+}
+
+/* Called when the sensor has signaled (measurement or calibration step done),
+ * busy is set if the sensor is (still) calibrating and shouldn't measure. */
+static vl53l0x_result_e vl53l0x_update_recalibration(vl53l0x_idx_e idx,
+                                                     bool *busy) {
+  *busy = false;
+  if (recalibration != RECALIBRATION_NONE && idx != recalibration_idx) {
+    return VL53L0X_RESULT_OK;
+  }
+  i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
+  switch (recalibration) {
+  case RECALIBRATION_NONE:
+    /* Put off in threshold mode, the sensor wouldn't signal the calibration
+     * steps */
+    if (threshold_mm || !(recalibration_mask & VL53L0X_MASK(idx))) {
+      return VL53L0X_RESULT_OK;
+    }
+    recalibration_idx = idx;
+    *busy = true;
+    if (continuous && (independent_mask & VL53L0X_MASK(idx))) {
+      recalibration = RECALIBRATION_STOPPING;
+      return vl53l0x_stop_sysrange_continuous(idx);
+    }
+    if (staggered_mask & VL53L0X_MASK(idx)) {
+      // Idle until its next period, so it stops right away
+      staggered_mask &= ~VL53L0X_MASK(idx);
+      const vl53l0x_result_e result = vl53l0x_stop_sysrange_continuous(idx);
+      if (result) {
         return result;
+      }
     }
-    result = vl53l0x_start_sysrange(VL53L0X_IDX_RIGHT);
+    recalibration = RECALIBRATION_VHV;
+    return vl53l0x_start_ref_calibration(VL53L0X_CALIBRATION_TYPE_VHV);
+  case RECALIBRATION_STOPPING:
+    *busy = true;
+    recalibration = RECALIBRATION_VHV;
+    return vl53l0x_start_ref_calibration(VL53L0X_CALIBRATION_TYPE_VHV);
+  case RECALIBRATION_VHV: {
+    *busy = true;
+    recalibration = RECALIBRATION_PHASE;
+    const vl53l0x_result_e result = vl53l0x_finish_ref_calibration();
     if (result) {
-        return result;
+      return result;
     }
-#endif
+    return vl53l0x_start_ref_calibration(VL53L0X_CALIBRATION_TYPE_PHASE);
+  }
+  case RECALIBRATION_PHASE:
+    return vl53l0x_recalibration_done(idx);
+  }
   return VL53L0X_RESULT_OK;
 }
 
-static vl53l0x_ranges_t latest_ranges = {
-    VL53L0X_OUT_OF_RANGE, VL53L0X_OUT_OF_RANGE, VL53L0X_OUT_OF_RANGE,
-    VL53L0X_OUT_OF_RANGE, VL53L0X_OUT_OF_RANGE};
+// Waits for an ongoing calibration step, the sensor is recalibrated later
+static vl53l0x_result_e vl53l0x_abort_recalibration(void) {
+  if (recalibration == RECALIBRATION_NONE) {
+    return VL53L0X_RESULT_OK;
+  }
+  const bool calibrating = vl53l0x_recalibrating(recalibration_idx);
+  recalibration = RECALIBRATION_NONE;
+  if (!calibrating) {
+    return VL53L0X_RESULT_OK;
+  }
+  i2c_set_slave_address(vl53l0x_cfgs[recalibration_idx].addr);
+  const vl53l0x_result_e result = vl53l0x_finish_ref_calibration();
+  if (result) {
+    return result;
+  }
+  return vl53l0x_set_sequence_steps_enabled(
+      sensor_sequence_steps[recalibration_idx]);
+}
+
+#define SAMPLE_NONE                                                            \
+  {.range = VL53L0X_OUT_OF_RANGE, .status = VL53L0X_RANGE_STATUS_NONE}
+static struct vl53l0x_sample latest_samples[VL53L0X_IDX_COUNT] = {
+    SAMPLE_NONE, SAMPLE_NONE, SAMPLE_NONE, SAMPLE_NONE, SAMPLE_NONE};
 
 /*
- * The approach is as follow:
- * For multiple sensors and single interrupt line:
- * 1. Start measure on all sensors
- * 2. If measurement ready
- *    - Read measurement of all sensors
- * 3. else
- *    - Return old values
- * 4. Update measurement ready on interrupt
+ * Sensors that fail too often are reset in the background, one at a time
+ * since a sensor boots with the default address:
+ * - Standby: XSHUT low for a while to power cycle it
+ * - Booting: XSHUT high, polled until it answers (at the default address)
+ * - Then given its address and configured again with the cached calibration
+ *   and the profile it had, a step per call so it doesn't hold up the others.
+ *   The phase calibration of a custom profile is waited for like a sample.
+ * A failed reset is retried after a longer standby. Once reset, the sensor is
+ * back on the schedule.
  */
-// TODO: Verify this works after bring up real robot
-vl53l0x_result_e vl53l0x_read_range_multiple(vl53l0x_ranges_t ranges,
-                                             bool *fresh_values) {
-  ASSERT(initialized);
-  vl53l0x_result_e result = VL53L0X_RESULT_OK;
-  if (status_multiple == STATUS_MULTIPLE_NOT_STARTED) {
-    result = vl53l0x_start_measuring_multiple();
-    if (result) {
-      return result;
+#define RESET_STANDBY_US (10000ul)
+#define RESET_RETRY_STANDBY_US (500000ul)
+/* A sensor that hasn't signaled within this is restarted, it's more than a
+ * measurement (or calibration step) takes */
+#define SAMPLE_TIMEOUT_MARGIN_US (50000ul)
+
+typedef enum {
+  RESET_NONE,
+  RESET_STANDBY,
+  RESET_BOOTING,
+  RESET_DATA_INIT,   // Has its address
+  RESET_TUNING,      // SPADs set
+  RESET_STATIC_INIT, // Tuning settings loaded
+  RESET_PHASE_CAL,   // Of its custom profile, signals when done
+} reset_e;
+
+static reset_e reset = RESET_NONE;
+static vl53l0x_idx_e reset_idx = VL53L0X_IDX_FRONT;
+static uint32_t reset_state_us = 0;
+static uint32_t reset_standby_us = RESET_STANDBY_US;
+
+/* Back on the schedule, independent sensors are started here and the others
+ * with their next slot */
+static void vl53l0x_restart_sensor(vl53l0x_idx_e idx) {
+  if (status_multiple != STATUS_MULTIPLE_MEASURING) {
+    return;
+  }
+  if (!(independent_mask & VL53L0X_MASK(idx))) {
+    staggered_mask &= ~VL53L0X_MASK(idx);
+    return;
+  }
+  const uint8_t mode =
+      continuous ? SYSRANGE_MODE_BACK_TO_BACK : SYSRANGE_MODE_SINGLESHOT;
+  if (vl53l0x_start_sysrange_mode(idx, mode)) {
+    vl53l0x_sensor_failed(idx);
+  }
+}
+
+// Sensors that got a sample beyond the threshold (not fresh, see below)
+static uint8_t beyond_threshold_mask = 0;
+
+/* In threshold mode, a sensor that didn't signal within a measurement (and a
+ * bit) has nothing below the threshold */
+static void vl53l0x_beyond_threshold(vl53l0x_idx_e idx) {
+  beyond_threshold_mask |= VL53L0X_MASK(idx);
+  struct vl53l0x_sample *sample = &latest_samples[idx];
+  sample->timestamp_us = timestamp_us();
+  sample->range = VL53L0X_OUT_OF_RANGE;
+  sample->status = VL53L0X_RANGE_STATUS_NONE;
+  waiting_since_us[idx] = sample->timestamp_us;
+  slot_pending &= ~VL53L0X_MASK(idx);
+  // Still measuring in continuous mode
+  if (!continuous) {
+    vl53l0x_restart_sensor(idx);
+  }
+}
+
+// Time from one sample of a sensor to the next
+static uint32_t vl53l0x_sample_interval_us(vl53l0x_idx_e idx) {
+  if (staggered_mask & VL53L0X_MASK(idx)) {
+    return 1000ul * stagger_period_ms;
+  }
+  return vl53l0x_timing_budget_us(idx);
+}
+
+/* A staggered sensor measured during its timing budget before it signaled. The
+ * overlapping sensors measure at the same point of each period, so that must
+ * be between their measurements, else it's stopped and started again with its
+ * slot (see vl53l0x_start_slot). */
+static void vl53l0x_check_stagger(vl53l0x_idx_e idx, uint32_t ready_us) {
+  if (!(staggered_mask & VL53L0X_MASK(idx))) {
+    return;
+  }
+  stagger_ready_us[idx] = ready_us;
+  const uint32_t period_us = 1000ul * stagger_period_ms;
+  const uint32_t budget_us = vl53l0x_timing_budget_us(idx);
+  for (uint8_t i = 0; i < active_count; i++) {
+    const vl53l0x_idx_e other = active_idxs[i];
+    if (!(overlap_masks[idx] & staggered_mask & VL53L0X_MASK(other)) ||
+        !stagger_ready_us[other]) {
+      continue;
     }
-    // Block here the first time
-    while (status_multiple != STATUS_MULTIPLE_DONE) {
+    // Where this measurement ended in the period of the other sensor
+    const int32_t since_us = (int32_t)(ready_us - stagger_ready_us[other]);
+    uint32_t phase_us = (uint32_t)(since_us < 0 ? -since_us : since_us);
+    phase_us %= period_us;
+    if (since_us < 0 && phase_us) {
+      phase_us = period_us - phase_us;
+    }
+    if (phase_us < budget_us ||
+        phase_us > period_us - vl53l0x_timing_budget_us(other)) {
+      staggered_mask &= ~VL53L0X_MASK(idx);
+      if (vl53l0x_stop_sysrange_continuous(idx)) {
+        vl53l0x_sensor_failed(idx);
+      }
+      return;
     }
   }
+}
 
-  if (status_multiple == STATUS_MULTIPLE_DONE
-      // We already know front is done because of its interrupt
-      //&& vl53l0x_is_sysrange_done(VL53L0X_IDX_FRONT)
-      && vl53l0x_is_sysrange_done(VL53L0X_IDX_LEFT) &&
-      vl53l0x_is_sysrange_done(VL53L0X_IDX_RIGHT) &&
-      vl53l0x_is_sysrange_done(VL53L0X_IDX_FRONT_LEFT) &&
-      vl53l0x_is_sysrange_done(VL53L0X_IDX_FRONT_RIGHT)) {
-
-    if (!vl53l0x_is_sysrange_done(VL53L0X_IDX_FRONT)) {
-      // Sanity check!
-      ASSERT(false);
+static void vl53l0x_check_timeouts(void) {
+  for (uint8_t i = 0; i < active_count; i++) {
+    const vl53l0x_idx_e idx = active_idxs[i];
+    const uint8_t mask = VL53L0X_MASK(idx);
+    const bool waiting =
+        (independent_mask | staggered_mask | slot_pending) & mask;
+    if (!waiting || (resetting_mask & mask) || sample_ready[idx]) {
+      continue;
+    }
+    const uint32_t budget_us = vl53l0x_timing_budget_us(idx);
+    const uint32_t interval_us = vl53l0x_sample_interval_us(idx);
+    if (threshold_mm) {
+      if (timestamp_elapsed_us(waiting_since_us[idx]) >=
+          interval_us + budget_us / 4) {
+        vl53l0x_beyond_threshold(idx);
+      }
+      continue;
+    }
+    const uint32_t timeout_us = 2 * interval_us + SAMPLE_TIMEOUT_MARGIN_US;
+    if (timestamp_elapsed_us(waiting_since_us[idx]) < timeout_us) {
+      continue;
+    }
+    vl53l0x_sensor_failed(idx);
+    if (idx == recalibration_idx && recalibration != RECALIBRATION_NONE) {
+      // Drift is kept, so it's recalibrated once it's working again
+      if (vl53l0x_abort_recalibration()) {
+        vl53l0x_sensor_failed(idx);
+      }
+    }
+    if (resetting_mask & mask) {
+      continue;
     }
+    waiting_since_us[idx] = timestamp_us();
+    vl53l0x_restart_sensor(idx);
+  }
+}
 
-    result = vl53l0x_read_range(VL53L0X_IDX_FRONT,
-                                &latest_ranges[VL53L0X_IDX_FRONT]);
+static void vl53l0x_enter_reset_standby(uint32_t standby_us) {
+  vl53l0x_set_hardware_standby(reset_idx, true);
+  reset = RESET_STANDBY;
+  reset_state_us = timestamp_us();
+  reset_standby_us = standby_us;
+}
+
+/* Configures the sensor again after it has booted, one step of
+ * vl53l0x_init_config (and vl53l0x_apply_profile) per call. Sets the next
+ * state, RESET_NONE once done. */
+static vl53l0x_result_e vl53l0x_reinit_step(vl53l0x_idx_e idx) {
+  const struct vl53l0x_calibration *calibration = &calibrations[idx];
+  vl53l0x_result_e result = VL53L0X_RESULT_OK;
+  switch (reset) {
+  case RESET_NONE:
+  case RESET_STANDBY:
+    return VL53L0X_RESULT_OK;
+  case RESET_BOOTING:
+    reset = RESET_DATA_INIT;
+    return vl53l0x_configure_address(vl53l0x_cfgs[idx].addr);
+  case RESET_DATA_INIT:
+    reset = RESET_TUNING;
+    i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
+    result = vl53l0x_data_init();
     if (result) {
       return result;
     }
-#if defined(NSUMO)
-    result = vl53l0x_read_range(VL53L0X_IDX_FRONT_LEFT,
-                                &latest_ranges[VL53L0X_IDX_FRONT_LEFT]);
+    return vl53l0x_set_spads(calibration->spad_map);
+  case RESET_TUNING:
+    reset = RESET_STATIC_INIT;
+    i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
+    return vl53l0x_load_default_tuning_settings();
+  case RESET_STATIC_INIT:
+    i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
+    result = vl53l0x_configure_interrupt();
     if (result) {
       return result;
     }
-    result = vl53l0x_read_range(VL53L0X_IDX_FRONT_RIGHT,
-                                &latest_ranges[VL53L0X_IDX_FRONT_RIGHT]);
+    result = vl53l0x_set_sequence_steps_enabled(SEQUENCE_STEPS_DEFAULT);
     if (result) {
       return result;
     }
-#endif
-#if 0 // Skip left and right, since they are are mounted badly
-        result = vl53l0x_read_range(VL53L0X_IDX_LEFT, &latest_ranges[VL53L0X_IDX_LEFT]);
-        if (result) {
-            return result;
-        }
-        result = vl53l0x_read_range(VL53L0X_IDX_RIGHT, &latest_ranges[VL53L0X_IDX_RIGHT]);
-        if (result) {
-            return result;
-        }
-#endif
+    result = vl53l0x_set_ref_calibration(calibration);
+    if (result || !(custom_profile_mask & VL53L0X_MASK(idx))) {
+      break;
+    }
+    result = vl53l0x_configure_profile(idx, &custom_profiles[idx]);
+    if (result) {
+      return result;
+    }
+    // Signals like a sample, the pin may have signaled while powered down
+    sample_ready[idx] = false;
+    reset = RESET_PHASE_CAL;
+    reset_state_us = timestamp_us();
+    return vl53l0x_start_ref_calibration(VL53L0X_CALIBRATION_TYPE_PHASE);
+  case RESET_PHASE_CAL:
+    if (!sample_ready[idx]) {
+      return timestamp_elapsed_us(reset_state_us) <
+                     1000ul * VL53L0X_POLL_TIMEOUT_MS
+                 ? VL53L0X_RESULT_OK
+                 : VL53L0X_RESULT_ERROR_I2C;
+    }
+    sample_ready[idx] = false;
+    i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
+    // Already done, so this doesn't wait
+    result = vl53l0x_finish_ref_calibration();
+    if (result) {
+      return result;
+    }
+    result =
+        vl53l0x_set_sequence_steps_enabled(custom_profiles[idx].sequence_steps);
+    break;
+  }
+  if (result) {
+    return result;
+  }
+  reset = RESET_NONE;
+  if (threshold_mm) {
+    result = vl53l0x_configure_threshold(idx, threshold_mm);
+  }
+  return result;
+}
+
+static void vl53l0x_update_reset(void) {
+  switch (reset) {
+  case RESET_NONE:
+    if (!resetting_mask) {
+      return;
+    }
+    while (!(resetting_mask & VL53L0X_MASK(reset_idx))) {
+      reset_idx = (reset_idx + 1) % VL53L0X_IDX_COUNT;
+    }
+    // Powered down, so the calibration can't be finished
+    if (reset_idx == recalibration_idx) {
+      recalibration = RECALIBRATION_NONE;
+    }
+    health[reset_idx].resets++;
+    vl53l0x_enter_reset_standby(RESET_STANDBY_US);
+    return;
+  case RESET_STANDBY:
+    if (timestamp_elapsed_us(reset_state_us) < reset_standby_us) {
+      return;
+    }
+    vl53l0x_set_hardware_standby(reset_idx, false);
+    reset = RESET_BOOTING;
+    reset_state_us = timestamp_us();
+    return;
+  case RESET_BOOTING:
+    i2c_set_slave_address(VL53L0X_DEFAULT_ADDRESS);
+    if (device_is_booted()) {
+      if (timestamp_elapsed_us(reset_state_us) >= VL53L0X_BOOT_TIMEOUT_US) {
+        health[reset_idx].failed_resets++;
+        vl53l0x_enter_reset_standby(RESET_RETRY_STANDBY_US);
+      }
+      return;
+    }
+    break;
+  case RESET_DATA_INIT:
+  case RESET_TUNING:
+  case RESET_STATIC_INIT:
+  case RESET_PHASE_CAL:
+    break;
+  }
+  if (vl53l0x_reinit_step(reset_idx)) {
+    health[reset_idx].failed_resets++;
+    vl53l0x_enter_reset_standby(RESET_RETRY_STANDBY_US);
+    return;
+  }
+  if (reset != RESET_NONE) {
+    return;
+  }
+  // Reset, the pin may have signaled while powered down
+  reset = RESET_NONE;
+  resetting_mask &= ~VL53L0X_MASK(reset_idx);
+  health[reset_idx].resetting = false;
+  health[reset_idx].consecutive_failures = 0;
+  sample_ready[reset_idx] = false;
+  vl53l0x_restart_sensor(reset_idx);
+}
+
+void vl53l0x_get_health(vl53l0x_idx_e idx,
+                        struct vl53l0x_health *sensor_health) {
+  ASSERT(idx < VL53L0X_IDX_COUNT);
+  *sensor_health = health[idx];
+}
+
+vl53l0x_result_e vl53l0x_stop_continuous(void) {
+  ASSERT(initialized);
+  vl53l0x_result_e result = vl53l0x_abort_recalibration();
+  for (uint8_t i = 0; i < active_count; i++) {
+    const vl53l0x_idx_e idx = active_idxs[i];
+    if (!((independent_mask | staggered_mask) & VL53L0X_MASK(idx)) ||
+        (resetting_mask & VL53L0X_MASK(idx))) {
+      continue;
+    }
+    const vl53l0x_result_e stop_result =
+        vl53l0x_stop_sysrange_continuous(idx);
+    // Stop as many as possible
+    if (stop_result) {
+      result = stop_result;
+    }
+  }
+  continuous = false;
+  staggered_mask = 0;
+  status_multiple = STATUS_MULTIPLE_NOT_STARTED;
+  return result;
+}
+
+static void vl53l0x_update_rate(vl53l0x_idx_e idx, uint32_t sample_us) {
+  if (last_sample_us[idx]) {
+    const uint32_t period_us = sample_us - last_sample_us[idx];
+    sample_period_us[idx] = sample_period_us[idx]
+                                ? (3 * sample_period_us[idx] + period_us) / 4
+                                : period_us;
+  }
+  last_sample_us[idx] = sample_us;
+}
+
+/*
+ * For each sensor with a ready sample (signaled by its GPIO1 interrupt):
+ * - Read its measurement
+ * - If independent, restart it right away (unless continuous)
+ * - Else start the next slot if it was the last one of the current slot. In
+ *   continuous mode check that it's still staggered instead, the next slot
+ *   starts once the window of the current one is over.
+ * Sets fresh for the sensors read, and leaves the others untouched. Sensors
+ * that fail are counted (see vl53l0x_sensor_failed) and skipped.
+ */
+static void vl53l0x_update_multiple(vl53l0x_fresh_t fresh) {
+  for (uint8_t i = 0; i < active_count; i++) {
+    const vl53l0x_idx_e idx = active_idxs[i];
+    if (!sample_ready[idx] || (resetting_mask & VL53L0X_MASK(idx))) {
+      continue;
+    }
+    /* Cleared before reading, so in continuous mode a sample that finishes
+     * meanwhile isn't missed */
+    CRITICAL_SECTION_ENTER();
+    const uint32_t ready_us = sample_ready_us[idx];
+    sample_ready[idx] = false;
+    CRITICAL_SECTION_EXIT();
+    waiting_since_us[idx] = ready_us;
+    bool failed = false;
+    // Not a measurement if it's a calibration step
+    const bool calibrated = vl53l0x_recalibrating(idx);
+    if (!calibrated) {
+      if (vl53l0x_read_result(idx, &latest_samples[idx], ready_us)) {
+        vl53l0x_sensor_failed(idx);
+        failed = true;
+      } else {
+        fresh[idx] = true;
+        health[idx].consecutive_failures = 0;
+        vl53l0x_update_rate(idx, ready_us);
+      }
+    }
+    bool busy = false;
+    if (!failed && vl53l0x_update_recalibration(idx, &busy)) {
+      // Drift is kept, so it's recalibrated once it's working again
+      recalibration = RECALIBRATION_NONE;
+      vl53l0x_sensor_failed(idx);
+      failed = true;
+    }
+    if (busy || (resetting_mask & VL53L0X_MASK(idx))) {
+      continue;
+    }
+    if (continuous && !calibrated && !failed) {
+      vl53l0x_check_stagger(idx, ready_us);
+    } else if (continuous || (independent_mask & VL53L0X_MASK(idx))) {
+      // Back-to-back (or timed) ranging was stopped for the calibration
+      vl53l0x_restart_sensor(idx);
+    } else {
+      slot_pending &= ~VL53L0X_MASK(idx);
+    }
+  }
+  vl53l0x_check_timeouts();
+  vl53l0x_update_reset();
+  if (slot_count && vl53l0x_slot_done()) {
+    vl53l0x_start_slot((slot + 1) % slot_count);
+  }
+}
+
+// TODO: Verify this works after bring up real robot
+vl53l0x_result_e vl53l0x_read_samples_multiple(vl53l0x_samples_t samples,
+                                               vl53l0x_fresh_t fresh) {
+  ASSERT(initialized);
+  vl53l0x_result_e result = VL53L0X_RESULT_OK;
+  for (int i = 0; i < VL53L0X_IDX_COUNT; i++) {
+    fresh[i] = false;
+  }
+  if (status_multiple == STATUS_MULTIPLE_NOT_STARTED) {
     result = vl53l0x_start_measuring_multiple();
     if (result) {
       return result;
     }
-    *fresh_values = true;
+    /* Block here the first time, until all sensors have been read once (or
+     * are being reset). In threshold mode a sensor with nothing within it is
+     * never read, its sample beyond the threshold counts instead. */
+    beyond_threshold_mask = 0;
+    bool all_sampled = false;
+    while (!all_sampled) {
+      vl53l0x_update_multiple(fresh);
+      all_sampled = true;
+      for (uint8_t i = 0; i < active_count; i++) {
+        const vl53l0x_idx_e idx = active_idxs[i];
+        const uint8_t done_mask = resetting_mask | beyond_threshold_mask;
+        all_sampled &= fresh[idx] || (done_mask & VL53L0X_MASK(idx));
+      }
+    }
   } else {
-    *fresh_values = false;
+    vl53l0x_update_multiple(fresh);
   }
+  vl53l0x_check_temperature_drift();
+
   for (int i = 0; i < VL53L0X_IDX_COUNT; i++) {
-    ranges[i] = latest_ranges[i];
+    samples[i] = latest_samples[i];
+  }
+  return result;
+}
+
+vl53l0x_result_e vl53l0x_read_range_multiple(vl53l0x_ranges_t ranges,
+                                             vl53l0x_fresh_t fresh) {
+  vl53l0x_samples_t samples;
+  const vl53l0x_result_e result = vl53l0x_read_samples_multiple(samples, fresh);
+  if (!result) {
+    for (int i = 0; i < VL53L0X_IDX_COUNT; i++) {
+      ranges[i] = samples[i].range;
+    }
   }
   return result;
 }
 
+void vl53l0x_get_latest_sample(vl53l0x_idx_e idx,
+                               struct vl53l0x_sample *sample) {
+  ASSERT(idx < VL53L0X_IDX_COUNT);
+  *sample = latest_samples[idx];
+}
+
+void vl53l0x_get_update_rates(vl53l0x_rates_t rates) {
+  for (int i = 0; i < VL53L0X_IDX_COUNT; i++) {
+    rates[i] = sample_period_us[i] ? 1000000000ul / sample_period_us[i] : 0;
+  }
+}
+
+void vl53l0x_boot_trace(void) {
+  TRACE("vl53l0x boot addresses %lu us config %lu us calibration %lu us",
+        boot_stage_us[BOOT_STAGE_ADDRESSES], boot_stage_us[BOOT_STAGE_CONFIG],
+        boot_stage_us[BOOT_STAGE_CALIBRATION]);
+  TRACE("vl53l0x present 0x%x calibrated 0x%x (others cached)", present_mask,
+        boot_calibrated_mask);
+}
+
+uint8_t vl53l0x_get_present_mask(void) { return present_mask; }
+
+uint8_t vl53l0x_get_active_mask(void) { return active_mask; }
+
+uint8_t vl53l0x_get_independent_mask(void) { return independent_mask; }
+
+vl53l0x_result_e vl53l0x_set_active_mask(uint8_t mask) {
+  if (status_multiple == STATUS_MULTIPLE_MEASURING) {
+    return VL53L0X_RESULT_ERROR_MEASURE_ONGOING;
+  }
+  active_mask = mask & present_mask;
+  active_count = 0;
+  for (vl53l0x_idx_e idx = 0; idx < VL53L0X_IDX_COUNT; idx++) {
+    if (active_mask & VL53L0X_MASK(idx)) {
+      active_idxs[active_count++] = idx;
+    }
+  }
+  // Recalibration only tracks the active sensors
+  recalibration_mask &= active_mask;
+  vl53l0x_schedule_init();
+  return VL53L0X_RESULT_OK;
+}
+
+/* Initialization is done in stages (instead of sensor by sensor) so that the
+ * calibration of each sensor runs while the next one is configured. */
 vl53l0x_result_e vl53l0x_init(void) {
   ASSERT(!initialized);
 
-  // TODO: Tune this delay (required to make the VL53L0X communication work)
-  __delay_cycles(5000);
-
   i2c_init();
+  // The sensors support fast mode (400 kHz)
+  i2c_set_speed(I2C_SPEED_FAST);
 
+  uint32_t stage_start_us = timestamp_us();
   vl53l0x_result_e result = vl53l0x_init_addresses();
   if (result) {
     return result;
   }
-  result = vl53l0x_init_config(VL53L0X_IDX_FRONT);
-  if (result) {
-    return result;
-  }
-#if defined(NSUMO)
-  result = vl53l0x_init_config(VL53L0X_IDX_LEFT);
-  if (result) {
-    return result;
+  boot_stage_us[BOOT_STAGE_ADDRESSES] = timestamp_elapsed_us(stage_start_us);
+
+  stage_start_us = timestamp_us();
+  /* Sensors without a cached calibration (e.g. never stored or corrupt), or
+   * with one done on another sensor (replaced or swapped), are calibrated and
+   * the cache updated. */
+  if (!info_flash_load(INFO_FLASH_SEGMENT_VL53L0X, calibrations,
+                       sizeof(calibrations))) {
+    for (vl53l0x_idx_e idx = 0; idx < VL53L0X_IDX_COUNT; idx++) {
+      calibrations[idx].valid = false;
+    }
   }
-  result = vl53l0x_init_config(VL53L0X_IDX_RIGHT);
-  if (result) {
-    return result;
+  for (vl53l0x_idx_e idx = 0; idx < ARRAY_SIZE(vl53l0x_cfgs); idx++) {
+    if (!(present_mask & VL53L0X_MASK(idx))) {
+      continue;
+    }
+    struct vl53l0x_calibration *calibration = &calibrations[idx];
+    bool cached = calibration->valid;
+    if (cached) {
+      // A failed read is a miss too, the sensor is just calibrated again
+      uint32_t part_uid[2] = {0};
+      i2c_set_slave_address(vl53l0x_cfgs[idx].addr);
+      cached = !vl53l0x_get_part_uid(part_uid) &&
+               calibration->part_uid[0] == part_uid[0] &&
+               calibration->part_uid[1] == part_uid[1];
+    }
+    // Else the UID is read with the SPAD info (see vl53l0x_init_config)
+    if (!cached) {
+      calibration->valid = false;
+      boot_calibrated_mask |= VL53L0X_MASK(idx);
+    }
+    result = vl53l0x_init_config(idx, cached);
+    if (result) {
+      return result;
+    }
   }
-  result = vl53l0x_init_config(VL53L0X_IDX_FRONT_LEFT);
-  if (result) {
-    return result;
+  boot_stage_us[BOOT_STAGE_CONFIG] = timestamp_elapsed_us(stage_start_us);
+
+  stage_start_us = timestamp_us();
+  if (boot_calibrated_mask) {
+    result = vl53l0x_init_calibration(boot_calibrated_mask);
+    if (result) {
+      return result;
+    }
+    info_flash_store(INFO_FLASH_SEGMENT_VL53L0X, calibrations,
+                     sizeof(calibrations));
   }
-  result = vl53l0x_init_config(VL53L0X_IDX_FRONT_RIGHT);
-  if (result) {
-    return result;
+  boot_stage_us[BOOT_STAGE_CALIBRATION] = timestamp_elapsed_us(stage_start_us);
+
+  for (vl53l0x_idx_e idx = 0; idx < ARRAY_SIZE(vl53l0x_cfgs); idx++) {
+    if (present_mask & VL53L0X_MASK(idx)) {
+      vl53l0x_configure_sensor_interrupt(idx);
+    }
   }
-#endif
+  vl53l0x_set_active_mask(ACTIVE_MASK_DEFAULT);
   initialized = true;
   return VL53L0X_RESULT_OK;
 }
@@ -21,16 +21,89 @@ typedef enum {
   VL53L0X_RESULT_ERROR_BOOT,
   VL53L0X_RESULT_ERROR_SPAD,
   VL53L0X_RESULT_ERROR_MEASURE_ONGOING,
+  VL53L0X_RESULT_ERROR_PROFILE,
+  VL53L0X_RESULT_ERROR_NOT_PRESENT, // Didn't answer at boot (or being reset)
+  VL53L0X_RESULT_ERROR_THRESHOLD_MODE,
 } vl53l0x_result_e;
 
+// Bitmask of sensors
+#define VL53L0X_MASK(idx) (1u << (idx))
+
 typedef uint16_t vl53l0x_ranges_t[VL53L0X_IDX_COUNT];
+typedef bool vl53l0x_fresh_t[VL53L0X_IDX_COUNT];
+typedef uint16_t vl53l0x_rates_t[VL53L0X_IDX_COUNT]; // mHz
+
+// Range status reported by the sensor (device error codes of the ST API)
+typedef enum {
+  VL53L0X_RANGE_STATUS_NONE,
+  VL53L0X_RANGE_STATUS_VCSEL_CONTINUITY_FAIL,
+  VL53L0X_RANGE_STATUS_VCSEL_WATCHDOG_FAIL,
+  VL53L0X_RANGE_STATUS_NO_VHV_VALUE_FOUND,
+  VL53L0X_RANGE_STATUS_MSRC_NO_TARGET,
+  VL53L0X_RANGE_STATUS_SNR_CHECK,
+  VL53L0X_RANGE_STATUS_RANGE_PHASE_CHECK,
+  VL53L0X_RANGE_STATUS_SIGMA_THRESHOLD_CHECK,
+  VL53L0X_RANGE_STATUS_TCC,
+  VL53L0X_RANGE_STATUS_PHASE_CONSISTENCY,
+  VL53L0X_RANGE_STATUS_MIN_CLIP,
+  VL53L0X_RANGE_STATUS_RANGE_COMPLETE,
+  VL53L0X_RANGE_STATUS_ALGO_UNDERFLOW,
+  VL53L0X_RANGE_STATUS_ALGO_OVERFLOW,
+  VL53L0X_RANGE_STATUS_RANGE_IGNORE_THRESHOLD,
+} vl53l0x_range_status_e;
+
+/* A single measurement. Rates are in MCPS (Q9.7 fixed point, see
+ * VL53L0X_MCPS) and the SPAD count is in Q8.8 fixed point. The timestamp is
+ * when the sensor signaled it was done (see timestamp_us), so the age of the
+ * sample is timestamp_elapsed_us(sample.timestamp_us). */
+struct vl53l0x_sample {
+  uint32_t timestamp_us;
+  uint16_t range; // VL53L0X_OUT_OF_RANGE if the status is bad
+  uint16_t signal_rate;
+  uint16_t ambient_rate;
+  uint16_t spad_count;
+  uint16_t seq; // Per sensor, increments for each sample (gaps are misses)
+  vl53l0x_range_status_e status;
+};
+typedef struct vl53l0x_sample vl53l0x_samples_t[VL53L0X_IDX_COUNT];
 
 /**
- * Initializes the sensors in the vl53l0x_idx_e enum.
+ * Initializes the sensors in the vl53l0x_idx_e enum. Sensors that don't answer
+ * are skipped (see vl53l0x_get_present_mask).
+ * @return VL53L0X_RESULT_ERROR_BOOT if no sensor answers
  * @note Each sensor must have its XSHUT pin connected.
  */
 vl53l0x_result_e vl53l0x_init(void);
 
+/**
+ * Sensors (VL53L0X_MASK) that answered when probed by vl53l0x_init
+ */
+uint8_t vl53l0x_get_present_mask(void);
+
+/**
+ * Selects the sensors (VL53L0X_MASK) measured by the *_multiple and
+ * *_continuous functions, sensors that aren't present are left out. The
+ * others keep VL53L0X_OUT_OF_RANGE (or their last range).
+ * @return VL53L0X_RESULT_ERROR_MEASURE_ONGOING if measuring
+ */
+vl53l0x_result_e vl53l0x_set_active_mask(uint8_t mask);
+uint8_t vl53l0x_get_active_mask(void);
+
+/**
+ * Active sensors (VL53L0X_MASK) that don't overlap any other active sensor, so
+ * they are measured independently (and free-run in continuous mode). The
+ * others take turns in slots (time windows in continuous mode). None with the
+ * default mask, since the front sensor overlaps both front left and front
+ * right.
+ */
+uint8_t vl53l0x_get_independent_mask(void);
+
+/**
+ * Traces how long each stage of vl53l0x_init took, and if the calibration was
+ * loaded from flash.
+ */
+void vl53l0x_boot_trace(void);
+
 /**
  * Does a single range measurement (starts and polls until it's finished)
  * @param idx selects specific sensor
@@ -41,20 +114,140 @@ vl53l0x_result_e vl53l0x_init(void);
  */
 vl53l0x_result_e vl53l0x_read_range_single(vl53l0x_idx_e idx, uint16_t *range);
 
+/**
+ * Same as vl53l0x_read_range_single but gives the whole sample (status and
+ * signal quality along with the range)
+ */
+vl53l0x_result_e vl53l0x_read_sample_single(vl53l0x_idx_e idx,
+                                            struct vl53l0x_sample *sample);
+
+#define VL53L0X_RESULT_BLOCK_SIZE (12u)
+/**
+ * Decodes the result block (starting at RESULT_RANGE_STATUS) as stored by
+ * i2c_read (reversed, last register first) into the status, signal quality and
+ * range of sample, with the range VL53L0X_OUT_OF_RANGE if the status is bad.
+ * Leaves the timestamp and sequence number untouched.
+ */
+void vl53l0x_decode_result_block(const uint8_t *block,
+                                 struct vl53l0x_sample *sample);
+
 /**
  * Reads all sensors. This is faster than reading sensors individually because
- * we do the measures in parallel. It starts measuring if no measurement is
- * ongoing and will return cached values if the measuring is not finished.
+ * we do the measures in parallel. Each sensor signals on its own interrupt
+ * line when its measurement is done, so it's read as soon as it's done.
+ * Sensors with overlapping fields of view would disturb each other, so they
+ * take turns (staggered) while the others measure in parallel.
  * @param ranges contains the measured ranges (or VL53L0X_OUT_OF_RANGE
  *        if out of range).
- * @param fresh_values is true if the values are from a new measurement and
- *        false if cached values.
- * @return see vl53l0x_result_e
- * @note Blocks until range measurement is done when called the first time
- * (unless vl53l0x_start_measuring_multiple has been called)
- * @note Returns values from the last measurement if measuring is not finished
+ * @param fresh is true for each sensor with a value from a new measurement
+ *        and false for those with a cached value.
+ * @return see vl53l0x_result_e, a sensor that fails doesn't fail the others
+ *         (see vl53l0x_get_health)
+ * @note Blocks until each sensor has a measurement (or, in threshold mode, a
+ * sample beyond the threshold) when called the first time (unless
+ * vl53l0x_start_measuring_multiple has been called)
  */
 vl53l0x_result_e vl53l0x_read_range_multiple(vl53l0x_ranges_t ranges,
-                                             bool *fresh_values);
+                                             vl53l0x_fresh_t fresh);
+
+/**
+ * Same as vl53l0x_read_range_multiple but gives the whole samples, e.g. to
+ * know how old each range is.
+ */
+vl53l0x_result_e vl53l0x_read_samples_multiple(vl53l0x_samples_t samples,
+                                               vl53l0x_fresh_t fresh);
+
+/**
+ * Effective update rate of each sensor read by vl53l0x_read_range_multiple
+ * (averaged over the last samples), 0 if not measured.
+ */
+void vl53l0x_get_update_rates(vl53l0x_rates_t rates);
+
+/**
+ * Latest sample of the sensor read by vl53l0x_read_range_multiple, for
+ * more details than the range.
+ */
+void vl53l0x_get_latest_sample(vl53l0x_idx_e idx,
+                               struct vl53l0x_sample *sample);
+
+/* A sensor read by the *_multiple functions that fails (I2C error or no
+ * sample in time) is restarted. After a few failures in a row, it's reset in
+ * the background instead (power cycled through XSHUT and configured again)
+ * while the other sensors keep ranging. */
+struct vl53l0x_health {
+  uint16_t failures;            // Since boot
+  uint16_t resets;              // Started since boot
+  uint16_t failed_resets;       // Retried after a while
+  uint8_t consecutive_failures; // Cleared by a good sample
+  bool resetting;               // Not ranging until reset
+};
+
+void vl53l0x_get_health(vl53l0x_idx_e idx, struct vl53l0x_health *health);
+
+// Steps of the ranging sequence, combine with +
+#define VL53L0X_SEQUENCE_STEP_TCC (0x10)  // Target CentreCheck
+#define VL53L0X_SEQUENCE_STEP_MSRC (0x04) // Minimum Signal Rate Check
+#define VL53L0X_SEQUENCE_STEP_DSS (0x28)  // Dynamic SPAD selection
+#define VL53L0X_SEQUENCE_STEP_PRE_RANGE (0x40)
+#define VL53L0X_SEQUENCE_STEP_FINAL_RANGE (0x80)
+
+// Signal rate in mega counts per second as 9.7 fixed point
+#define VL53L0X_MCPS(mcps) ((uint16_t)((mcps) * (1 << 7)))
+
+/* The timing budget is the time of one measurement, a longer one gives more
+ * accurate ranges. Longer VCSEL (laser) pulse periods and a lower signal rate
+ * limit increase the max range, but also the risk of bad readings. */
+struct vl53l0x_profile {
+  uint32_t timing_budget_us;        // >= 20 ms
+  uint8_t pre_range_vcsel_period;   // 12, 14, 16 or 18 PCLKs
+  uint8_t final_range_vcsel_period; // 8, 10, 12 or 14 PCLKs
+  uint8_t sequence_steps;           // VL53L0X_SEQUENCE_STEP_*
+  uint16_t signal_rate_limit;       // See VL53L0X_MCPS
+};
+
+// Based on the profiles in the ST API
+typedef enum {
+  VL53L0X_PROFILE_DEFAULT,    // ~33 ms, what the sensors are initialized with
+  VL53L0X_PROFILE_HIGH_SPEED, // ~20 ms, fewer steps (e.g. while attacking)
+  VL53L0X_PROFILE_LONG_RANGE, // ~33 ms, long pulses (e.g. while searching)
+  VL53L0X_PROFILE_COUNT
+} vl53l0x_profile_e;
+
+/**
+ * Applies a ranging profile to a sensor (blocking, it reruns the phase
+ * calibration since it depends on the VCSEL periods).
+ * @return VL53L0X_RESULT_ERROR_PROFILE if the values are out of range or the
+ *         steps don't fit in the timing budget
+ * @note Not while measuring or ranging continuously
+ */
+vl53l0x_result_e vl53l0x_set_profile(vl53l0x_idx_e idx,
+                                     const struct vl53l0x_profile *profile);
+vl53l0x_result_e vl53l0x_set_preset_profile(vl53l0x_idx_e idx,
+                                            vl53l0x_profile_e profile);
+
+/**
+ * In threshold mode the sensors only signal a sample if its range is below the
+ * threshold, so they're only read (over I2C) when something is within it. A
+ * sensor that doesn't signal in time (a measurement) gets a sample with
+ * VL53L0X_OUT_OF_RANGE instead (not fresh).
+ * @param threshold_mm 0 to signal every sample again (default)
+ * @note Not while measuring or ranging continuously. While in threshold mode
+ * vl53l0x_read_range_single is unavailable, the drift recalibration is put
+ * off, and only I2C errors count as failures (see vl53l0x_get_health).
+ */
+vl53l0x_result_e vl53l0x_set_threshold_mode(uint16_t threshold_mm);
+
+/**
+ * Starts continuous (back-to-back) ranging on the sensors read by
+ * vl53l0x_read_range_multiple. The sensors then start a new measurement as
+ * soon as the previous one is done, and vl53l0x_read_range_multiple only reads
+ * the results and clears the interrupts instead of restarting each sensor.
+ * Sensors that overlap others are still staggered: they free-run in timed mode
+ * instead, each slot measuring in its own time window, and are started again
+ * in their window if they drift out of it.
+ * @note vl53l0x_read_range_single is unavailable until stopped
+ */
+vl53l0x_result_e vl53l0x_start_continuous(void);
+vl53l0x_result_e vl53l0x_stop_continuous(void);
 
 #endif // VL53L0X_H
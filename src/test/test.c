@@ -8,13 +8,16 @@
 #include "drivers/pwm.h"
 #include "drivers/l298n_motordriver.h"
 #include "drivers/adc.h"
+#include "drivers/battery.h"
 #include "drivers/qre1113.h"
 #include "drivers/i2c.h"
 #include "drivers/vl53lox.h"
+#include "drivers/timestamp.h"
 #include "app/drive.h"
 #include "app/line.h"
 #include "app/enemy.h"
 #include <msp430.h>
+#include <stddef.h>
 //#include "external/printf/printf.h"
 #include "common/trace.h"
 
@@ -367,6 +370,71 @@ static void test_adc(void)
 	}
 }
 
+/* Traces the spread (max - min) of each channel over one second, to compare the
+ * noise with different oversampling (ADC_OVERSAMPLING_LOG2 in adc.c), e.g.
+ * with the motors running, and the max time taken by the filter. */
+SUPPRESS_UNUSED
+static void test_adc_oversampling(void)
+{
+    test_setup();
+    trace_init();
+    adc_init();
+    const uint8_t channel_count = 4; // The line sensors
+    while (1) {
+        uint16_t mins[ADC_CHANNEL_COUNT];
+        uint16_t maxs[ADC_CHANNEL_COUNT];
+        for (uint8_t i = 0; i < channel_count; i++) {
+            mins[i] = UINT16_MAX;
+            maxs[i] = 0;
+        }
+        uint16_t last_seq = 0;
+        uint16_t sequences = 0;
+        const uint32_t start_us = timestamp_us();
+        while (timestamp_elapsed_us(start_us) < 1000000) {
+            adc_channel_values_t values;
+            const uint16_t seq = adc_get_channel_values(values);
+            if (seq == last_seq) {
+                continue;
+            }
+            last_seq = seq;
+            sequences++;
+            for (uint8_t i = 0; i < channel_count; i++) {
+                if (values[i] < mins[i]) {
+                    mins[i] = values[i];
+                }
+                if (values[i] > maxs[i]) {
+                    maxs[i] = values[i];
+                }
+            }
+        }
+        TRACE("%u samples/s, filter max %u cycles", sequences, adc_filter_cycles());
+        for (uint8_t i = 0; i < channel_count; i++) {
+            TRACE("  ch %u: %u-%u (spread %u)", i, mins[i], maxs[i], maxs[i] - mins[i]);
+        }
+    }
+}
+
+/* Traces the filtered battery voltage, e.g. to compare with a multimeter and
+ * to see the sag with the motors running (the duty cycle is scaled by it, see
+ * pwm.c) */
+SUPPRESS_UNUSED
+static void test_battery(void)
+{
+    test_setup();
+    trace_init();
+    adc_init();
+    pwm_init(); // Starts filtering the battery voltage
+    while (1) {
+        uint16_t voltage_mv = 0;
+        if (battery_get_voltage_mv(&voltage_mv)) {
+            TRACE("Battery %u mV", voltage_mv);
+        } else {
+            TRACE("Battery not measured");
+        }
+        BUSY_WAIT_ms(500);
+    }
+}
+
 SUPPRESS_UNUSED
 static void test_qre1113(void)
 {
@@ -396,6 +464,20 @@ static void test_line(void)
 	}
 }
 
+// Traces the line as soon as it changes (move the sensors over the line)
+SUPPRESS_UNUSED
+static void test_line_changed(void)
+{
+    test_setup();
+    trace_init();
+    line_init();
+    while (1) {
+        if (line_changed()) {
+            TRACE("Line %u at %lu us", line_get(), timestamp_us());
+        }
+    }
+}
+
 SUPPRESS_UNUSED
 static void test_i2c(void)
 {
@@ -439,6 +521,215 @@ static void test_i2c(void)
 }
 
 
+static volatile uint16_t i2c_async_callback_count = 0;
+static void i2c_async_callback(struct i2c_transaction *transaction)
+{
+    UNUSED(transaction);
+    i2c_async_callback_count++;
+}
+
+/* Same setup as test_i2c, but submits the read through the transaction queue
+ * and counts how many loop iterations the CPU gets while the transaction is
+ * executed in the background by the I2C interrupt. Each read must succeed,
+ * give the VL53L0X ID and call the callback once. */
+SUPPRESS_UNUSED
+static void test_i2c_async(void)
+{
+    test_setup();
+    trace_init();
+    i2c_init();
+    io_set_out(IO_XSHUT_FRONT, IO_OUT_HIGH);
+    // Wait for VL53L0X to leave standby
+    BUSY_WAIT_ms(100);
+    const uint8_t id_reg = 0xC0;
+    uint8_t vl53l0x_id = 0;
+    struct i2c_transaction transaction = {
+        .slave_addr = 0x29,
+        .dir = I2C_DIR_READ,
+        .addr = &id_reg,
+        .addr_size = 1,
+        .rx_data = &vl53l0x_id,
+        .data_size = 1,
+        .callback = i2c_async_callback,
+    };
+    uint16_t submitted = 0;
+    while (1) {
+        uint32_t free_loops = 0;
+        vl53l0x_id = 0;
+        i2c_submit(&transaction);
+        submitted++;
+        while (transaction.status != I2C_STATUS_DONE) {
+            free_loops++;
+        }
+        TRACE("Read id 0x%X (result %d), %lu free loops, %u callbacks", vl53l0x_id,
+              transaction.result, free_loops, i2c_async_callback_count);
+        ASSERT(transaction.result == I2C_RESULT_OK);
+        ASSERT(vl53l0x_id == 0xEE);
+        ASSERT(i2c_async_callback_count == submitted);
+        BUSY_WAIT_ms(1000);
+    }
+}
+
+
+/* Reads from a VL53L0X (default address) as fast as possible for one second at
+ * each bus speed and reports the number of transactions per second, both for
+ * single register reads and for 12-byte burst reads (the range result block). */
+SUPPRESS_UNUSED
+static void test_i2c_speed_benchmark(void)
+{
+    test_setup();
+    trace_init();
+    i2c_init();
+    io_set_out(IO_XSHUT_FRONT, IO_OUT_HIGH);
+    i2c_set_slave_address(0x29);
+    // Wait for VL53L0X to leave standby
+    BUSY_WAIT_ms(100);
+    const i2c_speed_e speeds[] = {I2C_SPEED_STANDARD, I2C_SPEED_FAST, I2C_SPEED_CUSTOM};
+    const char *speed_names[] = {"standard", "fast", "custom"};
+    const uint8_t burst_sizes[] = {1, 12};
+    while (1) {
+        for (uint8_t i = 0; i < ARRAY_SIZE(speeds); i++) {
+            i2c_set_speed(speeds[i]);
+            i2c_stats_reset();
+            for (uint8_t j = 0; j < ARRAY_SIZE(burst_sizes); j++) {
+                const uint8_t reg = 0x14; // REG_RESULT_RANGE_STATUS
+                uint8_t data[12];
+                uint32_t transactions = 0;
+                uint32_t errors = 0;
+                const uint32_t start_us = timestamp_us();
+                while (timestamp_elapsed_us(start_us) < 1000000u) {
+                    if (i2c_read(&reg, 1, data, burst_sizes[j])) {
+                        errors++;
+                    }
+                    transactions++;
+                }
+                TRACE("%s %u bytes: %lu transactions/s (%lu errors)", speed_names[i],
+                      burst_sizes[j], transactions, errors);
+            }
+            i2c_stats_trace();
+        }
+        BUSY_WAIT_ms(1000);
+    }
+}
+
+/* Holds SDA low with a fake slave (on top of the real bus with a VL53L0X
+ * connected) and checks that the recovery clocks it free, that a slave that
+ * never lets go fails the recovery, and that a stuck bus is detected when a
+ * transaction times out. After each, the stats must have counted it and the
+ * next transaction must succeed. */
+#ifndef DISABLE_I2C_STATS
+/* Fake slave holding SDA, through the line hook of the I2C driver. The
+ * recovery samples SDA (with the pins as GPIO) before each clock pulse, so it
+ * lets go after release_pulses low samples (never if 0). */
+static struct {
+    bool holding_sda;
+    uint8_t release_pulses;
+    uint8_t low_samples;
+} i2c_fake_slave;
+
+bool i2c_line_released(io_e io)
+{
+    if (io != IO_I2C_SDA || !i2c_fake_slave.holding_sda) {
+        return io_get_input(io) == IO_IN_HIGH;
+    }
+    struct io_config config;
+    io_get_current_config(io, &config);
+    if (config.select != IO_SELECT_GPIO) {
+        return false;
+    }
+    if (i2c_fake_slave.release_pulses &&
+        i2c_fake_slave.low_samples >= i2c_fake_slave.release_pulses) {
+        i2c_fake_slave.holding_sda = false;
+        return io_get_input(io) == IO_IN_HIGH;
+    }
+    i2c_fake_slave.low_samples++;
+    return false;
+}
+
+static void i2c_fake_slave_hold(uint8_t release_pulses)
+{
+    i2c_fake_slave.holding_sda = true;
+    i2c_fake_slave.release_pulses = release_pulses;
+    i2c_fake_slave.low_samples = 0;
+}
+
+static void i2c_expect_recoveries(uint16_t stuck, uint16_t recovered)
+{
+    struct i2c_stats stats;
+    i2c_stats_get(&stats);
+    TRACE("Bus stuck %u recovered %u", stats.bus_stuck, stats.bus_recovered);
+    ASSERT(stats.bus_stuck == stuck);
+    ASSERT(stats.bus_recovered == recovered);
+}
+
+static void i2c_expect_bus_working(void)
+{
+    uint8_t model_id = 0;
+    const i2c_result_e result = i2c_read_addr8_data8(0xC0, &model_id);
+    ASSERT(result == I2C_RESULT_OK);
+    ASSERT(model_id == 0xEE);
+}
+
+SUPPRESS_UNUSED
+static void test_i2c_bus_recovery(void)
+{
+    test_setup();
+    trace_init();
+    i2c_init();
+    io_set_out(IO_XSHUT_FRONT, IO_OUT_HIGH);
+    i2c_set_slave_address(0x29);
+    // Wait for VL53L0X to leave standby
+    BUSY_WAIT_ms(100);
+    i2c_expect_bus_working();
+    i2c_stats_reset();
+
+    // Lets go after 3 clock pulses
+    i2c_fake_slave_hold(3);
+    ASSERT(i2c_bus_recover());
+    ASSERT(i2c_fake_slave.low_samples == 3);
+    ASSERT(!i2c_fake_slave.holding_sda);
+    i2c_expect_recoveries(1, 1);
+    i2c_expect_bus_working();
+
+    /* Never lets go, the recovery gives up after 9 pulses and checks SDA once
+     * more after the stop condition */
+    i2c_fake_slave_hold(0);
+    ASSERT(!i2c_bus_recover());
+    ASSERT(i2c_fake_slave.low_samples == 9 + 1);
+    i2c_expect_recoveries(2, 1);
+    i2c_fake_slave.holding_sda = false;
+    i2c_expect_bus_working();
+
+    /* Stuck in the middle of a read, which times out (deadline shorter than
+     * the transfer). The timeout interrupt must detect it and recover. */
+    i2c_fake_slave_hold(5);
+    const uint8_t reg = 0xC0;
+    uint8_t data[12];
+    struct i2c_transaction transaction = {
+        .slave_addr = 0x29,
+        .dir = I2C_DIR_READ,
+        .addr = &reg,
+        .addr_size = 1,
+        .rx_data = data,
+        .data_size = ARRAY_SIZE(data),
+        .timeout_us = 1,
+    };
+    i2c_submit(&transaction);
+    while (transaction.status != I2C_STATUS_DONE) {
+    }
+    ASSERT(transaction.result == I2C_RESULT_ERROR_TIMEOUT);
+    ASSERT(i2c_fake_slave.low_samples == 5);
+    ASSERT(!i2c_fake_slave.holding_sda);
+    i2c_expect_recoveries(3, 2);
+    i2c_expect_bus_working();
+
+    TRACE("Bus recovery passed");
+    i2c_stats_trace();
+    while (1) {
+    }
+}
+#endif
+
 SUPPRESS_UNUSED
 void test_vl53l0x(void)
 {
@@ -450,21 +741,115 @@ void test_vl53l0x(void)
     }
 
     while (1) {
-        uint16_t range = 0;
-        result = vl53l0x_read_range_single(VL53L0X_IDX_FRONT, &range);
+        struct vl53l0x_sample sample;
+        result = vl53l0x_read_sample_single(VL53L0X_IDX_FRONT, &sample);
         if (result) {
             TRACE("Range measure failed (result %u)", result);
         } else {
-            if (range != VL53L0X_OUT_OF_RANGE) {
-                TRACE("Range %u mm", range);
+            if (sample.range != VL53L0X_OUT_OF_RANGE) {
+                TRACE("Range %u mm", sample.range);
             } else {
                 TRACE("Out of range");
             }
+            TRACE("Status %u signal %u ambient %u spads %u", sample.status, sample.signal_rate,
+                  sample.ambient_rate, sample.spad_count >> 8);
         }
         BUSY_WAIT_ms(1000);
     }
 }
 
+/* Decodes a known result block (as stored by i2c_read, last register first)
+ * and checks each field against the register it comes from */
+SUPPRESS_UNUSED
+static void test_vl53l0x_decode_result(void)
+{
+    test_setup();
+    trace_init();
+    // Register order: status, -, spads (2), -, -, signal (6), ambient (8), range (10)
+    const uint8_t registers[VL53L0X_RESULT_BLOCK_SIZE] = {
+        VL53L0X_RANGE_STATUS_RANGE_COMPLETE << 3, 0xAA, 0x12, 0x34, 0xBB, 0xCC,
+        0x56, 0x78, 0x9A, 0xBC, 0x01, 0x2C};
+    uint8_t block[VL53L0X_RESULT_BLOCK_SIZE];
+    for (uint8_t i = 0; i < VL53L0X_RESULT_BLOCK_SIZE; i++) {
+        block[i] = registers[VL53L0X_RESULT_BLOCK_SIZE - 1 - i];
+    }
+    struct vl53l0x_sample sample;
+    vl53l0x_decode_result_block(block, &sample);
+    ASSERT(sample.status == VL53L0X_RANGE_STATUS_RANGE_COMPLETE);
+    ASSERT(sample.spad_count == 0x1234);
+    ASSERT(sample.signal_rate == 0x5678);
+    ASSERT(sample.ambient_rate == 0x9ABC);
+    ASSERT(sample.range == 300);
+
+    // A bad status rejects the range
+    block[VL53L0X_RESULT_BLOCK_SIZE - 1] = VL53L0X_RANGE_STATUS_MSRC_NO_TARGET << 3;
+    vl53l0x_decode_result_block(block, &sample);
+    ASSERT(sample.range == VL53L0X_OUT_OF_RANGE);
+    TRACE("Result block decoded as expected");
+    while (1) {
+    }
+}
+
+/* Checks which sensors are measured independently (not staggered in slots)
+ * for the default active mask and for a mask without the front sensor.
+ * Expects all sensors to be present. */
+SUPPRESS_UNUSED
+static void test_vl53l0x_schedule(void)
+{
+    test_setup();
+    trace_init();
+    vl53l0x_result_e result = vl53l0x_init();
+    ASSERT(!result);
+    const uint8_t front_left = VL53L0X_MASK(VL53L0X_IDX_FRONT_LEFT);
+    const uint8_t front_right = VL53L0X_MASK(VL53L0X_IDX_FRONT_RIGHT);
+    const uint8_t front = VL53L0X_MASK(VL53L0X_IDX_FRONT);
+    // The front overlaps both others, and they overlap the front
+    ASSERT(vl53l0x_get_active_mask() == (front | front_left | front_right));
+    ASSERT(vl53l0x_get_independent_mask() == 0);
+    // Without the front, front left and front right don't overlap
+    result = vl53l0x_set_active_mask(front_left | front_right);
+    ASSERT(!result);
+    ASSERT(vl53l0x_get_independent_mask() == (front_left | front_right));
+    // Left overlaps front left only, right front right only
+    result = vl53l0x_set_active_mask(front | VL53L0X_MASK(VL53L0X_IDX_LEFT) |
+                                     VL53L0X_MASK(VL53L0X_IDX_RIGHT));
+    ASSERT(!result);
+    ASSERT(vl53l0x_get_independent_mask() == vl53l0x_get_active_mask());
+    TRACE("Independent sensors as expected");
+    while (1) {
+    }
+}
+
+SUPPRESS_UNUSED
+static void test_vl53l0x_profiles(void)
+{
+    test_setup();
+    trace_init();
+    vl53l0x_result_e result = vl53l0x_init();
+    if (result) {
+        TRACE("vl53l0x_init failed");
+    }
+    const char *profile_names[] = {"default", "high speed", "long range"};
+    while (1) {
+        for (vl53l0x_profile_e profile = 0; profile < VL53L0X_PROFILE_COUNT; profile++) {
+            result = vl53l0x_set_preset_profile(VL53L0X_IDX_FRONT, profile);
+            if (result) {
+                TRACE("Set profile failed (result %u)", result);
+                continue;
+            }
+            for (uint8_t i = 0; i < 5; i++) {
+                uint16_t range = 0;
+                const uint32_t start_us = timestamp_us();
+                result = vl53l0x_read_range_single(VL53L0X_IDX_FRONT, &range);
+                const uint32_t duration_us = timestamp_elapsed_us(start_us);
+                TRACE("%s: range %u mm in %lu us (result %u)", profile_names[profile], range,
+                      duration_us, result);
+            }
+            BUSY_WAIT_ms(1000);
+        }
+    }
+}
+
 SUPPRESS_UNUSED
 void test_vl53l0x_multiple(void)
 {
@@ -474,11 +859,12 @@ void test_vl53l0x_multiple(void)
     if (result) {
         TRACE("vl53l0x_init failed");
     }
+    vl53l0x_boot_trace();
 
     while (1) {
         vl53l0x_ranges_t ranges = { 0, 0, 0, 0, 0 };
-        bool fresh_values = false;
-        result = vl53l0x_read_range_multiple(ranges, &fresh_values);
+        vl53l0x_fresh_t fresh;
+        result = vl53l0x_read_range_multiple(ranges, fresh);
         if (result) {
             TRACE("Range measure failed (result %u)", result);
         }
@@ -491,6 +877,150 @@ void test_vl53l0x_multiple(void)
     }
 }
 
+// Unplug/replug a sensor while running, it should be reset and range again
+SUPPRESS_UNUSED
+static void test_vl53l0x_health(void)
+{
+    test_setup();
+    trace_init();
+    vl53l0x_result_e result = vl53l0x_init();
+    if (result) {
+        TRACE("vl53l0x_init failed");
+    }
+    result = vl53l0x_start_continuous();
+    if (result) {
+        TRACE("Start continuous failed (result %u)", result);
+    }
+    uint32_t trace_us = timestamp_us();
+    while (1) {
+        vl53l0x_samples_t samples;
+        vl53l0x_fresh_t fresh;
+        result = vl53l0x_read_samples_multiple(samples, fresh);
+        if (result) {
+            TRACE("Range measure failed (result %u)", result);
+        }
+        if (timestamp_elapsed_us(trace_us) < 1000000) {
+            continue;
+        }
+        trace_us = timestamp_us();
+        for (vl53l0x_idx_e idx = 0; idx < VL53L0X_IDX_COUNT; idx++) {
+            struct vl53l0x_health health;
+            vl53l0x_get_health(idx, &health);
+            TRACE("%u: range %u failures %u (%u in a row) resets %u (%u failed)%s", idx,
+                  samples[idx].range, health.failures, health.consecutive_failures,
+                  health.resets, health.failed_resets, health.resetting ? " resetting" : "");
+        }
+    }
+}
+
+struct vl53l0x_benchmark {
+    uint16_t samples;
+    uint32_t interval_min_us;
+    uint32_t interval_max_us;
+    uint32_t interval_sum_us;
+    uint32_t last_us;
+};
+
+/* Runs the sensors read by vl53l0x_read_samples_multiple flat out for a few
+ * seconds with each mode (single shot, continuous and threshold) and profile,
+ * and reports a row per sensor: samples/s, min/mean/max interval between
+ * samples, I2C bus time per sample and failures (see vl53l0x_get_health). */
+SUPPRESS_UNUSED
+static void test_vl53l0x_benchmark(void)
+{
+    test_setup();
+    trace_init();
+    vl53l0x_result_e result = vl53l0x_init();
+    if (result) {
+        TRACE("vl53l0x_init failed");
+    }
+    vl53l0x_boot_trace();
+    const char *mode_names[] = {"single", "continuous", "threshold"};
+    const char *profile_names[] = {"default", "high speed", "long range"};
+    const uint32_t duration_us = 5000000;
+    while (1) {
+        for (uint8_t mode = 0; mode < ARRAY_SIZE(mode_names); mode++) {
+            for (vl53l0x_profile_e profile = 0; profile < VL53L0X_PROFILE_COUNT; profile++) {
+                for (vl53l0x_idx_e idx = 0; idx < VL53L0X_IDX_COUNT; idx++) {
+                    if (vl53l0x_get_active_mask() & VL53L0X_MASK(idx)) {
+                        vl53l0x_set_preset_profile(idx, profile);
+                    }
+                }
+                vl53l0x_set_threshold_mode(mode == 2 ? 600 : 0);
+                struct vl53l0x_benchmark benchmarks[VL53L0X_IDX_COUNT] = { 0 };
+                uint16_t failures_start[VL53L0X_IDX_COUNT];
+                for (vl53l0x_idx_e idx = 0; idx < VL53L0X_IDX_COUNT; idx++) {
+                    struct vl53l0x_health health;
+                    vl53l0x_get_health(idx, &health);
+                    failures_start[idx] = health.failures;
+                    benchmarks[idx].interval_min_us = UINT32_MAX;
+                }
+                i2c_stats_reset();
+                // Single shot starts with the first read
+                result = mode ? vl53l0x_start_continuous() : VL53L0X_RESULT_OK;
+                if (result) {
+                    TRACE("Start continuous failed (result %u)", result);
+                }
+                uint16_t errors = 0;
+                const uint32_t start_us = timestamp_us();
+                while (timestamp_elapsed_us(start_us) < duration_us) {
+                    vl53l0x_samples_t samples;
+                    vl53l0x_fresh_t fresh;
+                    if (vl53l0x_read_samples_multiple(samples, fresh)) {
+                        errors++;
+                        continue;
+                    }
+                    for (vl53l0x_idx_e idx = 0; idx < VL53L0X_IDX_COUNT; idx++) {
+                        struct vl53l0x_benchmark *benchmark = &benchmarks[idx];
+                        if (!fresh[idx]) {
+                            continue;
+                        }
+                        if (benchmark->samples) {
+                            const uint32_t interval_us = samples[idx].timestamp_us - benchmark->last_us;
+                            if (interval_us < benchmark->interval_min_us) {
+                                benchmark->interval_min_us = interval_us;
+                            }
+                            if (interval_us > benchmark->interval_max_us) {
+                                benchmark->interval_max_us = interval_us;
+                            }
+                            benchmark->interval_sum_us += interval_us;
+                        }
+                        benchmark->last_us = samples[idx].timestamp_us;
+                        benchmark->samples++;
+                    }
+                }
+                vl53l0x_stop_continuous();
+                uint32_t i2c_busy_us = 0;
+#ifndef DISABLE_I2C_STATS
+                struct i2c_stats stats;
+                i2c_stats_get(&stats);
+                i2c_busy_us = stats.busy_us;
+#endif
+                uint32_t total_samples = 0;
+                for (vl53l0x_idx_e idx = 0; idx < VL53L0X_IDX_COUNT; idx++) {
+                    total_samples += benchmarks[idx].samples;
+                }
+                TRACE("%s %s: %lu us on I2C per sample (%u read errors)", mode_names[mode],
+                      profile_names[profile], total_samples ? i2c_busy_us / total_samples : 0,
+                      errors);
+                for (vl53l0x_idx_e idx = 0; idx < VL53L0X_IDX_COUNT; idx++) {
+                    const struct vl53l0x_benchmark *benchmark = &benchmarks[idx];
+                    if (!benchmark->samples) {
+                        continue;
+                    }
+                    struct vl53l0x_health health;
+                    vl53l0x_get_health(idx, &health);
+                    const uint16_t intervals = benchmark->samples - 1;
+                    TRACE("  %u: %lu samples/s interval %lu/%lu/%lu us failures %u", idx,
+                          benchmark->samples * 1000000ul / duration_us,
+                          intervals ? benchmark->interval_min_us : 0,
+                          intervals ? benchmark->interval_sum_us / intervals : 0,
+                          benchmark->interval_max_us, health.failures - failures_start[idx]);
+                }
+            }
+        }
+    }
+}
 
 SUPPRESS_UNUSED
 void test_enemy(void)